@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <vector>
+#include <boost/unordered_map.hpp>
 
 #include "Forest.h"
 #include "Candidate.h"
@@ -25,36 +26,158 @@ struct XYZIndex {
     }
 };
 
+// local maximum of the hough space, sorted from the strongest to the weakest
+struct HoughPeak {
+    float val;
+    int scale, x, y;
+    bool operator<(const HoughPeak& a) const {
+        if( val != a.val ) return val > a.val;
+        if( scale != a.scale ) return scale < a.scale;
+        if( y != a.y ) return y < a.y;
+        return x < a.x;
+    }
+};
+
+// votes of one leaf for one class, taken by decreasing purity in the budgeted voting
+struct VoteGroup {
+    float purity;
+    double mass;
+    int leaf, c;
+    bool operator<(const VoteGroup& a) const {
+        if( purity != a.purity ) return purity > a.purity;
+        if( leaf != a.leaf ) return leaf < a.leaf;
+        return c < a.c;
+    }
+};
+
+// Sparse 4D hough space over the quaternion components (qw, qz, qy, qx), only the bins receiving votes are stored
+struct PoseHoughSpace {
+
+    PoseHoughSpace( int s = 50 ) : steps( s ) {}
+
+    void clear() {
+        bins.clear();
+    }
+
+    // index of the bin the quaternion falls in, each component in [-1,1] is quantized into steps bins
+    int binIndex( const Eigen::Quaterniond& q ) const {
+        int qx = int( ( ( q.x() + 1.0 ) / 2.0 ) * ( steps - 1 ) );
+        int qy = int( ( ( q.y() + 1.0 ) / 2.0 ) * ( steps - 1 ) );
+        int qz = int( ( ( q.z() + 1.0 ) / 2.0 ) * ( steps - 1 ) );
+        int qw = int( ( ( q.w() + 1.0 ) / 2.0 ) * ( steps - 1 ) );
+        return ( ( qw * steps + qz ) * steps + qy ) * steps + qx;
+    }
+
+    void vote( const Eigen::Quaterniond& q, float weight ) {
+        bins[ binIndex( q ) ] += weight;
+    }
+
+    int steps;
+    boost::unordered_map< int, float > bins;
+};
+
 class CRForestDetector {
 public:
     // Constructor
-    CRForestDetector(const CRForest* pRF, int w, int h, double s_points=-1.0 ,double s_forest=-1.0, bool bpr = true) : crForest(pRF), width(w), height(h), sample_points(s_points),do_bpr(bpr) {
+    CRForestDetector(const CRForest* pRF, int w, int h, double s_points=-1.0 ,double s_forest=-1.0, bool bpr = true) : crForest(pRF), width(w), height(h), sample_points(s_points),do_bpr(bpr), deadline(0), frameDeadline(0), forestUsage(-1.f) {
         crForest->GetClassID(Class_id);
+        buildLeafProbabilities();
     }
 
     // Detection functions
 public:
-    void detectObject(const cv::Mat& img, const cv::Mat& depthImg, const vector<cv::Mat>& vImg,  const pcl::PointCloud<pcl::Normal>::Ptr& normals, const std::vector< cv::Mat >& vImgAssign, const std::vector<cv::Mat>& classProbs, const Parameters& p, int this_class, std::vector<Candidate >& candidates);
+    // with a focus only the pixels inside of it vote for the center
+    void detectObject(const cv::Mat& img, const cv::Mat& depthImg, const vector<cv::Mat>& vImg,  const pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Mat& imgAssign, const std::vector<cv::Mat>& classProbs, const QueryFrames& frames, const Parameters& p, int this_class, std::vector<Candidate >& candidates, cv::Rect* focus = NULL);
+
+    // regions of the coarse pass of the pyramid detection, one bounding rectangle per class and the mask of all regions
+    void coarseRegions(const cv::Mat& img, const cv::Mat& depthImg, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Mat& gate, const Parameters& p, std::vector<cv::Rect>& regions, cv::Mat& roiMask);
 
     void voteForCandidate( std::vector< cv::Mat> vimgAssign, Candidate& new_cand, int kernel_width, float max_width, float max_height  );
 
-    void getClassConfidence(const std::vector<cv::Mat>& vImgAssign,std::vector<cv::Mat>& classConfidence);
+    void getClassConfidence(const cv::Mat& imgAssign,std::vector<cv::Mat>& classConfidence);
 
-    void fullAssignCluster(const cv::Mat &img, const cv::Mat &depthImg, vector< cv::Mat > &vImgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals);
+    // leaf ids of all trees, pixel-major: imgAssign is of type CV_32SC(ntrees) and -1 marks pixels without assignment
+    // with cascadeTrees > 0 only the pixels with a foreground estimate of the first cascadeTrees trees >= cascadeThreshold are matched to the other trees
+    // if gate is given (CV_8UC1) only its nonzero pixels are matched at all
+    void fullAssignCluster(const cv::Mat &img, const cv::Mat &depthImg, cv::Mat &imgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, int cascadeTrees = 0, float cascadeThreshold = 0.f, const cv::Mat &gate = cv::Mat());
+
+    // mask of the pixels whose depth allows a vote for a center within the range of the scales, for all classes
+    // (pixels without depth are kept)
+    static void depthGate(const cv::Mat &depthImg, const std::vector<float>& scales, const std::vector<cv::Point3f>& vbbSize, cv::Mat &gate);
+
+    // probability of not being background averaged over the first nTrees trees (CV_32FC1, 0 for pixels without assignment)
+    void foregroundEstimate(const cv::Mat &imgAssign, int nTrees, cv::Mat &estimate);
+
+    // one CV_32FC1 leaf id image per tree (the former layout of the assignment)
+    static void splitAssignment(const cv::Mat &imgAssign, std::vector< cv::Mat > &vImgAssign);
 
     void trainStat(IplImage* img, CvRect bbox, std::vector< std::vector<float> >& stat, float inv_set_size = 1.0f);
 
     void transposeMatrix(cv::Mat src, cv::Mat &dst, int order, int nScales);
 
+    // wall time in seconds from now until the detection has to stop, 0 runs without deadline
+    void setDeadline(double seconds) {
+        deadline = seconds > 0 ? cv::getTickCount() + int64( seconds * cv::getTickFrequency() ) : 0;
+        frameDeadline = deadline;
+    }
+    // the next detection may use 1/parts of the time left until the deadline of the frame, so the detections
+    // which come later (e.g. the other classes) are not starved
+    void shareDeadline(int parts) {
+        if( frameDeadline > 0 ) {
+            int64 now = cv::getTickCount();
+            deadline = now + std::max( int64( 0 ), frameDeadline - now ) / std::max( 1, parts );
+        }
+    }
+    bool deadlinePassed() const {
+        return deadline > 0 && cv::getTickCount() >= deadline;
+    }
+
+    // part of the forest used by the last center voting if it was budgeted (1 if all votes were cast), -1 otherwise
+    float getForestUsage() const {
+        return forestUsage;
+    }
+
+    // the hough space accumulated over the frames of a sequence (houghDecay > 0) starts again from the next frame
+    void resetTemporalHough() {
+        temporalHough.clear();
+    }
+
+    // true if the mean depth change to the last frame is above threshold (in meter), the depth image is kept for the next frame
+    bool cameraMoved(const cv::Mat& depthImg, float threshold);
+
+    // time the center voting in pixel order against the voting grouped by leafs
+    void benchmarkCenterVoting(const cv::Mat& depthImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Mat& imgAssign, const std::vector<cv::Mat>& classProbs, const Parameters& p, int this_class, double& pixelOrderTime, double& leafOrderTime, float& maxDifference);
+
 
 private:
-    void assignCluster(const cv::Mat &img, const cv::Mat &depthImg, vector<cv::Mat> &vImgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals);
+    void buildLeafProbabilities();
+
+    void assignCluster(const cv::Mat &img, const cv::Mat &depthImg, cv::Mat &imgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, int firstTree, int lastTree, const cv::Mat& active = cv::Mat());
+
+    void voteForCenter(const cv::Mat& imgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const  cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const std::vector<float>& scales, int& this_class, cv::Rect* focus, const float& prob_threshold, const std::vector<cv::Mat>& classProbs, const Parameters& param, bool addPoseInformation = false,  bool addScaleInformation = false  );
+
+    void voteForCenterByLeaf(const cv::Mat& imgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<float>& scales, int this_class, float prob_threshold, const std::vector<cv::Mat>& classProbs, bool addScaleInformation, const cv::Rect& roi );
 
-    void voteForCenter(const std::vector<cv::Mat>& vImgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const  cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const std::vector<float>& scales, int& this_class, cv::Rect* focus, const float& prob_threshold, const std::vector<cv::Mat>& classProbs, const Parameters& param, bool addPoseInformation = false,  bool addScaleInformation = false  );
+    void voteForCenterBudgeted(const cv::Mat& imgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<float>& scales, int this_class, float prob_threshold, const std::vector<cv::Mat>& classProbs, bool addScaleInformation, long voteBudget, const cv::Rect& roi );
 
-    void detectCenterPeaks(std::vector<Candidate >& candidates, const std::vector<std::vector<cv::Mat> >& imgDetect, const std::vector<cv::Mat>& vImgAssign, const std::vector< std::vector< std::vector< std::vector<std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const  cv::Mat& depthImg, const cv::Mat& img, const Parameters& param, int this_class);
+    void computeQueryPoints(const cv::Mat& depthImg, std::vector< cv::Point3f >& qPoints, std::vector< uchar >& hasDepth);
 
-    void voteForPose(const cv::Mat img, const cv::Mat depthImg, const vector< vector< vector< vector< vector< std::pair< cv::Point, int > > > > > >& voterImages, const vector< cv::Mat >& vImgAssign, const vector< vector< cv::Mat > >& vImgDetect, vector< Candidate >& candidates, const vector< cv::Mat >& vImg, const pcl::PointCloud< pcl::Normal >::Ptr& normals, const int kernel_width, const std::vector< float >& scales, const float thresh, const bool DEBUG, const bool addPoseScore);
+    void groupPixelsByLeaf(const cv::Mat& imgAssign, int trNr, const std::vector< uchar >& hasDepth, const cv::Rect& roi, std::vector< int >& leafStart, std::vector< int >& pixels);
+
+    void selectVoters(const LeafNode* leaf, int trNr, int cNr, const int* begin, const int* end, int cols, float prob_threshold, const std::vector<cv::Mat>& classProbs, std::vector< int >& voters);
+
+    int castLeafVote(const cv::Point3f& offset, int voteIndex, float weight, const std::vector< int >& voters, std::vector< int >& count, const std::vector< cv::Point3f >& qPoints, int cols, int trNr, int cNr, std::vector< std::vector<cv::Mat> >& vImgDetect, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<float>& scales, bool addScaleInformation);
+
+    void smoothHoughSpace(std::vector< std::vector<cv::Mat> >& vImgDetect, int this_class, const Parameters& param);
+
+    void accumulateTemporalHough(std::vector< std::vector<cv::Mat> >& vImgDetect, int this_class, float decay, float density);
+
+    // pose of a candidate from its center only, with the camera orientation
+    static void centerPose(Candidate& candidate, const cv::Point2f& img_center);
+
+    void detectCenterPeaks(std::vector<Candidate >& candidates, const std::vector<std::vector<cv::Mat> >& imgDetect, const cv::Mat& imgAssign, const std::vector< std::vector< std::vector< std::vector<std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const  cv::Mat& depthImg, const cv::Mat& img, const Parameters& param, int this_class, int minVotes = 100);
+
+    void voteForPose(const cv::Mat img, const cv::Mat depthImg, const vector< vector< vector< vector< vector< std::pair< cv::Point, int > > > > > >& voterImages, const cv::Mat& imgAssign, const vector< vector< cv::Mat > >& vImgDetect, vector< Candidate >& candidates, const vector< cv::Mat >& vImg, const pcl::PointCloud< pcl::Normal >::Ptr& normals, const int kernel_width, const std::vector< float >& scales, const QueryFrames& frames, const float thresh, const bool DEBUG, const bool addPoseScore, const bool smoothPoseSpace = false);
 
     void detectPosePeaks(vector< cv::Mat > &positiveAcc, vector< cv::Mat> &negativeAcc, Eigen::Matrix3d &positiveFinalOC, Eigen::Matrix3d &negativeFinalOC);
 
@@ -64,8 +187,7 @@ private:
 
     void detectPosePeaks_slerp(std::vector<Eigen::Quaterniond>& qMean,Eigen::Matrix3d &finalOC);
 
-    void detectMaxima(const vector<vector<cv::Mat> >& poseHoughSpace,  Eigen::Quaterniond& finalOC, int& step, float& score);
-//    void detectMaxima(const vector<cv::Mat> & poseHoughSpace,  Eigen::Quaterniond& finalOC, int& step, float& score);
+    void detectMaxima(const PoseHoughSpace& poseHoughSpace,  Eigen::Quaterniond& finalOC, float& score, bool smooth = false);
 
     void detectMaximaK_means(std::vector<Eigen::Quaterniond>& qMean, Eigen::Matrix3d &finalOC);
 
@@ -94,4 +216,16 @@ private:
     int height;
     double sample_points;
     bool do_bpr;
+
+    // class probabilities of the leafs divided by the number of trees, leafProbabilities[tree][leaf * nlabels + class]
+    std::vector< std::vector< float > > leafProbabilities;
+
+    // tick count at which the detection stops (0: no deadline), and the one of the whole frame
+    int64 deadline;
+    int64 frameDeadline;
+    float forestUsage;
+
+    // exponentially decayed hough space of the past frames, temporalHough[class][scale], and the depth image of the last frame
+    std::vector< std::vector< cv::Mat > > temporalHough;
+    cv::Mat lastDepth;
 };
@@ -54,6 +54,7 @@ public:
 
     // Regression
     void regression(std::vector<int>& result, const std::vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, cv::Point &pt, float &scale) const;
+    void regression(std::vector<int>& result, int firstTree, int lastTree, const std::vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, cv::Point &pt, float &scale) const;
     void regression(std::vector<const LeafNode*>& result, std::vector<unsigned int>& trID, uchar** ptFCh, int stepImg, CvRNG* pRNG, double thresh ,float scale_tree = -1.0f) const;
 
     // Training
@@ -88,13 +89,25 @@ inline void CRForest::regression(std::vector<int>& result, const std::vector<cv:
     }
 }
 
+// Matching with the trees firstTree ... lastTree-1 only
+inline void CRForest::regression(std::vector<int>& result, int firstTree, int lastTree, const std::vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, cv::Point &pt, float &scale) const {
+    result.resize( lastTree - firstTree );
+    for(int i=firstTree; i<lastTree; ++i) {
+        result[i-firstTree] = vTrees[i]->regression(vImg, normals, pt, scale);
+    }
+}
+
 //Training
 inline void CRForest::
 trainForest(const Parameters& p, rawData& data, int min_s,  int samples ) {
 
-    // Init random generator
-    time_t t = time( NULL );
-    int seed = ( int )(t/double( p.off_tree + 1 ) );
+    // Init random generator, the trees draw from streams of the master seed given by their number
+    uint64 seed = p.rngSeed;
+    if( seed == 0 ) {
+        time_t t = time( NULL );
+        seed = ( uint64 )(t/double( p.off_tree + 1 ) );
+    }
+    cout << "Random seed: " << seed << endl;
     cv::RNG pRNG = cv::RNG( seed );
 
     // Init training data
@@ -102,29 +115,43 @@ trainForest(const Parameters& p, rawData& data, int min_s,  int samples ) {
     TrData.setClasses( p.nlabels );
     // Extract training patches
     CRForestTraining::extract_Pixels( data, p, TrData, &pRNG);
+    cout << "Peak memory after the extraction: " << peakMemory() << " MB" << endl;
+
+    // with fewer trees than cores the tests of a node are evaluated in parallel as well
+    int nTrees = std::max( 1, ( int )vTrees.size() - p.off_tree );
+    int treeThreads = std::min( nTrees, omp_get_max_threads() );
+    int nodeThreads = std::max( 1, omp_get_max_threads() / nTrees );
 
-    #pragma omp parallel for
+    // the trees and the tests of the nodes are two levels of parallel regions, the previous limit is restored after the training
+    int activeLevels = omp_get_max_active_levels();
+    if( nodeThreads > 1 )
+        omp_set_max_active_levels( std::max( activeLevels, 2 ) );
+
+    #pragma omp parallel for num_threads( treeThreads )
 
     for( int i = p.off_tree; i < ( int )vTrees.size(); ++i ) {
 
-        std::vector<std::vector< int > > numbers( TrData.vRPixels.size() );
+        StreamRNG treeRNG( seed, i );
+        std::vector<std::vector< int > > numbers( TrData.samples.size() );
 
-        for(int class_ = 0 ; class_ < TrData.vRPixels.size() ; class_++) {
-            numbers[class_].reserve(TrData.vRPixels[class_].size());
-            for( int j = 0; j < TrData.vRPixels[class_].size(); j++ ) {
+        for(int class_ = 0 ; class_ < TrData.samples.size() ; class_++) {
+            numbers[class_].reserve(TrData.samples[class_].size());
+            for( int j = 0; j < TrData.samples[class_].size(); j++ ) {
                 numbers[class_].push_back(j);
             }
 
             // shuffle and take a subset of the pixels
-            std::random_shuffle ( numbers[class_].begin(), numbers[class_].end() );
+            for( int j = ( int )numbers[class_].size() - 1; j > 0; --j )
+                std::swap( numbers[class_][j], numbers[class_][ treeRNG( j + 1 ) ] );
             numbers[class_].resize(static_cast<size_t>(0.50*static_cast<double>(numbers[class_].size())));
         }
 
-        CRTree* Trees = new CRTree( min_s, p.treedepth, TrData.vRPixels.size(), &pRNG );
+        CRTree* Trees = new CRTree( min_s, p.treedepth, TrData.samples.size(), treeRNG );
         Trees->setClassId( p.class_structure );
         Trees->SetScale( p.scale_tree );
         Trees->setTrainingMode( p.training_mode );
         Trees->setObjectSize( p.objectSize );
+        Trees->setNodeThreads( nodeThreads );
         Trees->growTree( p, TrData, samples, i, numbers);
 
         char buffer[ 200 ];
@@ -134,13 +161,8 @@ trainForest(const Parameters& p, rawData& data, int min_s,  int samples ) {
         delete Trees;
 
     }
-
-    for(vector< std::vector< PixelFeature* > >::iterator train = TrData.vRPixels.begin(); train!=TrData.vRPixels.end(); train++) {
-        for(std::vector< PixelFeature* >::iterator feature = train->begin(); feature!=train->end(); feature++) {
-
-            delete *feature;
-        }
-    }
+    omp_set_max_active_levels( activeLevels );
+    cout << "Peak memory after the training: " << peakMemory() << " MB" << endl;
 }
 
 // IO Functions
@@ -14,7 +14,7 @@ using namespace std;
 
 struct Parameters{
 
-    Parameters(){ scale_tree = -1.0f; sample_points_test = -1.0; }
+    Parameters(){ scale_tree = -1.0f; sample_points_test = -1.0; smoothPoseSpace = false; leafGroupedVoting = false; frameBudget = 0.0; voteBudget = 0; cascadeTrees = 0; cascadeThreshold = 0.f; cascadeRecall = 0.99f; depthGating = false; coarseStride = 0; coarseRelax = 0.5f; planeThreshold = 0.f; trackingInterval = 0; trackingMargin = 0.2f; houghDecay = 0.f; houghSubset = 1; motionReset = 0.05f; thresholdBins = 0; rngSeed = 0; }
 
     // name of config file
     string configFileName;
@@ -111,6 +111,64 @@ struct Parameters{
     // addPoseScore
     bool addPoseScore;
 
+    // smooth the pose hough space before taking its maximum (optional entry)
+    bool smoothPoseSpace;
+
+    // vote for the center grouped by leafs instead of in pixel order (optional entry)
+    bool leafGroupedVoting;
+
+    // wall time in seconds for the detection in one frame, 0 for no limit (optional entry); only the center and
+    // pose voting stop at it, the feature extraction and the assignment to the leafs always run to the end.
+    // Each class may use the time left divided by the number of classes still to detect
+    double frameBudget;
+
+    // maximal number of center votes cast for a class, 0 for no limit (optional entry)
+    long voteBudget;
+
+    // number of trees evaluated for all pixels before the rest of the forest, 0 evaluates all trees everywhere (optional entry)
+    int cascadeTrees;
+
+    // minimal foreground estimate of the first cascadeTrees trees for a pixel to reach the other trees (optional entry)
+    float cascadeThreshold;
+
+    // recall the cascade calibration (mode 4) has to keep (optional entry)
+    float cascadeRecall;
+
+    // match only the pixels whose depth allows a vote for a center in the range of the scales (optional entry)
+    bool depthGating;
+
+    // stride of the coarse pass of the pyramid detection, only the regions found in it are detected at full resolution, 0 or 1 for no pyramid (optional entry)
+    int coarseStride;
+
+    // the coarse pass keeps the peaks above coarseRelax * thresh_detection (optional entry)
+    float coarseRelax;
+
+    // distance in meter to the dominant plane (table, desk, ...) below which pixels are not matched, 0 keeps the plane (optional entry)
+    float planeThreshold;
+
+    // tracking of the detections of a test set: every trackingInterval-th frame is detected on the full frame, the others
+    // only in the regions of the last detections, 0 detects every frame on the full frame (optional entry)
+    int trackingInterval;
+
+    // the tracked regions are enlarged by this part of their size on each side (optional entry)
+    float trackingMargin;
+
+    // weight of the hough space of the past frames of a test set, 0 detects every frame on its own (optional entry)
+    float houghDecay;
+
+    // with houghDecay > 0 only every houghSubset-th pixel in x and y votes in a frame, rotating over the frames (optional entry)
+    int houghSubset;
+
+    // mean depth change in meter between frames above which the camera is taken as moved and the temporal hough space is reset (optional entry)
+    float motionReset;
+
+    // training: number of histogram bins for the threshold search of a test, all bin edges are tried;
+    // -1 tries all values of the test, 0 tries 10 random thresholds (optional entry)
+    int thresholdBins;
+
+    // training: master seed of the random streams of the trees, 0 seeds from the time (optional entry)
+    unsigned long rngSeed;
+
     // add surfel Channel
     bool addSurfel;
 
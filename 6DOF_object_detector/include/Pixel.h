@@ -23,31 +23,75 @@
 
 #define  PI 3.14159265f
 
-// structure for sampled image pixel
-
-
-struct PixelFeature {
-
-    int iWidth, iHeight;
-    float scale;
-    cv::Point2f  pixelLocation;
-    cv::Point3f  pixelLocation_real;
-    cv::Point3f disVector;
-    cv::Rect bbox;
-    std::vector< cv::Mat > imgAppearance;
-    Eigen::Matrix4d transformationMatrixOC;
-    pcl::PointCloud<pcl::Normal>::Ptr normals;
-    Eigen::Quaterniond disTransformation;
-    cv::Point3f bbSize3D;
-    Eigen::Matrix3d T_qC;
-
-
-    void print() const {
-        std::cout << "displacement vector = \n" << disVector << std::endl;
-        std::cout << "pixel coordinates = \n" << pixelLocation <<std::endl;
-        std::cout << "real coordinates = \n " << pixelLocation_real <<std::endl;
-        std::cout << "object coordinate system = \n" << transformationMatrixOC <<std::endl;
+// feature channels and normals of a training image, shared by all pixels sampled from it. Only the crop
+// which the tests of the pixels can reach is kept, the 8 bit and the 16 bit channels are each packed
+// plane after plane into one buffer
+struct TrainingImage {
+
+    unsigned int channels() const {
+        return plane.size();
+    }
+    // value of channel c at the pixel pt of the full image, pt has to lie in the crop
+    int value( int c, const cv::Point& pt ) const {
+        if( wide[ c ] )
+            return planes16.ptr< unsigned short >( plane[ c ] * crop.height + pt.y - crop.y )[ pt.x - crop.x ];
+        return planes8.ptr< uchar >( plane[ c ] * crop.height + pt.y - crop.y )[ pt.x - crop.x ];
+    }
+    pcl::Normal normal( const cv::Point& pt ) const {
+        const cv::Vec3f& n = normals.at< cv::Vec3f >( pt.y - crop.y, pt.x - crop.x );
+        return pcl::Normal( n[ 0 ], n[ 1 ], n[ 2 ] );
+    }
+
+    int id;
+    // size of the full image and the part of it which is kept
+    int width, height;
+    cv::Rect crop;
+    // plane of each channel in planes8 or planes16 (wide)
+    std::vector< int > plane;
+    std::vector< uchar > wide;
+    cv::Mat planes8, planes16;
+    // normals of the crop (CV_32FC3)
+    cv::Mat normals;
+};
+
+// training pixels of a class stored column by column, a pixel is an index into the columns
+struct SampleTable {
+
+    size_t size() const {
+        return image.size();
+    }
+    void reserve( size_t n ) {
+        image.reserve( n );
+        location.reserve( n );
+        scale.reserve( n );
+        offset.reserve( n );
+        orientation.reserve( n );
     }
+
+    // index of the image in CRPixel::images
+    std::vector< int > image;
+    // pixel coordinates
+    std::vector< cv::Point_< short > > location;
+    // inverse depth of the pixel
+    std::vector< float > scale;
+    // vector from the object center to the pixel in the camera frame
+    std::vector< cv::Point3f > offset;
+    // rotation from the object to the local frame of the pixel as quaternion w x y z
+    std::vector< cv::Vec4f > orientation;
+};
+
+// per-frame quantities needed for the local coordinate system of every query pixel
+struct QueryFrames {
+
+    QueryFrames() : width( 0 ), height( 0 ) {}
+
+    int width, height;
+    // 3D location of the pixel, normalized normal and their cross product normal x location
+    std::vector< Eigen::Vector3f > location;
+    std::vector< Eigen::Vector3f > normal;
+    std::vector< Eigen::Vector3f > normalCrossLocation;
+    // 0 if the normal is not defined
+    std::vector< uchar > valid;
 };
 
 
@@ -55,13 +99,12 @@ class CRPixel {
 public:
     CRPixel(cv::RNG* pRNG) : cvRNG(pRNG) {}
     void setClasses(int l) {
-        vRPixels.resize(l);
-        vImageIDs.resize(l);
-    }// vImageIDs.resize(l);}
+        samples.resize(l);
+    }
 
     // Extract patches from image
     void extractPixels(IplImage *img, unsigned int n, int label, CvRect* box = 0, CvPoint* vCenter = 0);
-    // Extract patches from image and adding its id to the patch (in vImageIDs)
+    // Extract patches from image and adding its id to the image (in images)
     void extractPixels(const Parameters& param, const cv::Mat &img, const cv::Mat &depthImg,const cv::Mat& maskImg, unsigned int n, int label, int imageID,  CvRect* box =0, CvPoint* vCenter=0, cv::Point3f *cg = 0 , cv::Point3f *bbDimension =0, Eigen::Matrix4d *transformationOC = 0 );
 
     // Convert pixel coordinates to real coordinates
@@ -71,10 +114,13 @@ public:
     static void R3toP3(cv::Point3f &realCoordinates, cv::Point2f &center, cv::Point2f &pixelCoordinates, float &depth);
 
     // Compute Normals
-    static void computeNormals(const cv::Mat& img, const cv::Mat& depthImg, pcl::PointCloud<pcl::Normal>::Ptr& normals);
+    static void computeNormals(const cv::Mat& img, const cv::Mat& depthImg, pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Point2f* principalPoint = NULL);
 
     // Extract features from image
-    static void extractFeatureChannels(const Parameters& param, const cv::Mat &img, const cv::Mat &depthImg, std::vector<cv::Mat>& vImg, pcl::PointCloud<pcl::Normal>::Ptr& normals);
+    static void extractFeatureChannels(const Parameters& param, const cv::Mat &img, const cv::Mat &depthImg, std::vector<cv::Mat>& vImg, pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Point2f* principalPoint = NULL);
+
+    // Extract features only inside roi, the channels and normals have the size of the image and are empty outside of roi
+    static void extractFeatureChannels(const Parameters& param, const cv::Mat &img, const cv::Mat &depthImg, const cv::Rect& roi, std::vector<cv::Mat>& vImg, pcl::PointCloud<pcl::Normal>::Ptr& normals);
 
     // calculate transformation from object frame to camera frame
     static void calcObject2CameraTransformation( float &pose, float &pitch, cv::Point3f &rObjCenter, Eigen::Matrix4d &transformationMatrixOC );
@@ -82,8 +128,14 @@ public:
     // calculate local coordinate system for pixel
     static Eigen::Matrix3d calcQueryPoint2CameraTransformation(cv::Point3f &real_coordinate, cv::Point3f &object_center, pcl::Normal p_n );
 
-    //calculate relative transformation from object to query pixel
-    void calcObject2QueryPointTransformation(PixelFeature& pf);
+    // precompute the normal dependent part of calcQueryPoint2CameraTransformation for all pixels of a frame
+    static void computeQueryFrames( const cv::Mat& depthImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, QueryFrames& frames );
+
+    // same as calcQueryPoint2CameraTransformation for the pixel with index idx using the precomputed frames
+    static Eigen::Matrix3d calcQueryPoint2CameraTransformation( const QueryFrames& frames, int idx, const Eigen::Vector3f& object_center );
+
+    //calculate relative transformation from object to query pixel, T_qC is the local frame of the pixel
+    static Eigen::Quaterniond calcObject2QueryPointTransformation(const cv::Point3f& real_coordinate, const cv::Point3f& disVector, const pcl::Normal& normal, const Eigen::Matrix4d& transformationMatrixOC, Eigen::Matrix3d& T_qC);
 
     // Draws transformation
     static void drawTransformation(const cv::Mat &img, const cv::Mat &depthImg , const Eigen::Matrix4d& transformationMatrixOC, const Eigen::Matrix3d &T_qC, const cv::Point3f& disVector);
@@ -105,8 +157,9 @@ public:
     static void minfilt(IplImage *src, unsigned int width);
     static void minfilt(cv::Mat src, cv::Mat  dst, unsigned int width);
 
-    std::vector<std::vector< PixelFeature* > > vRPixels;
-    std::vector<std::vector< int > > vImageIDs; // vector the same size as vRPixels
+    // training pixels of each class
+    std::vector< SampleTable > samples;
+    std::vector< TrainingImage > images;
 
 private:
     cv::RNG *cvRNG;
@@ -37,10 +37,11 @@ struct SurfelFeature {
 class Surfel {
 
 public:
-    static void imagesToPointCloud(const cv::Mat& depthImg, const cv::Mat& colorImg, pcl::PointCloud<pcl::PointXYZRGB>::Ptr& cloud);
+    static void imagesToPointCloud(const cv::Mat& depthImg, const cv::Mat& colorImg, pcl::PointCloud<pcl::PointXYZRGB>::Ptr& cloud, const cv::Point2f* principalPoint = NULL);
     static void imagesToPointCloud_( cv::Mat& depthImg, cv::Mat& colorImg, pcl::PointCloud< pcl::PointXYZRGB >::Ptr& cloud, cv::Mat &mask );
     static void houghPointCloud( std::vector<cv::Mat>& houghImg, const std::vector<float> &scales,  pcl::PointCloud< pcl::PointXYZRGB >::Ptr& cloud );
     static void computeSurfel(pcl::PointCloud<pcl::Normal>::Ptr normals, cv::Point2f pt1, cv::Point2f pt2, cv::Point2f center, SurfelFeature &sf, float depth1, float depth2);
+    static void computeSurfel(const pcl::Normal& n1, const pcl::Normal& n2, cv::Point2f pt1, cv::Point2f pt2, cv::Point2f center, SurfelFeature &sf, float depth1, float depth2);
     static void calcSurfel2CameraTransformation(cv::Point3f &s1, cv::Point3f &s2, pcl::Normal &n1, pcl::Normal &n2, Eigen::Matrix4d &TransformationSC1, Eigen::Matrix4d &TransformationSC2);
 //     static void calcQueryPoint2CameraTransformation(cv::Point3f &s1, cv::Point3f &s2, cv::Point3f &query_point, const pcl::Normal &qn1, Eigen::Matrix4d &TransformationQueryC1, Eigen::Matrix4d &TransformationQueryC2);
     static void addCoordinateSystem( Eigen::Matrix4d &transformationMatrixOC, boost::shared_ptr<pcl::visualization::PCLVisualizer> &viewer, string id);
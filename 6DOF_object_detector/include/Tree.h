@@ -19,6 +19,45 @@
 
 #include "Surfel.h"
 #include "Pixel.h"
+#include <Eigen/Eigenvalues>
+
+// Counter based random numbers for the training. The n-th number of a stream is a hash (SplitMix64)
+// of the stream key and n, so the trees and their nodes draw from independent streams derived from
+// one master seed, whatever the order and the thread in which they are grown
+class StreamRNG {
+public:
+    StreamRNG(uint64 seed = 0, uint64 key = 0) : state( mix( seed ^ mix( key + 0x9E3779B97F4A7C15ULL ) ) ), counter( 0 ) {}
+
+    // independent stream for key, e.g. a node or a test
+    StreamRNG stream(uint64 key) const {
+        return StreamRNG( state, key );
+    }
+
+    uint64 next64() {
+        return mix( state + ( ++counter ) * 0x9E3779B97F4A7C15ULL );
+    }
+    unsigned next() {
+        return unsigned( next64() >> 32 );
+    }
+    // uniform in [0, n)
+    unsigned operator()(unsigned n) {
+        return unsigned( ( ( next64() >> 32 ) * n ) >> 32 );
+    }
+    // uniform in [a, b)
+    float uniform(float a, float b) {
+        return a + ( b - a ) * float( next64() >> 40 ) * ( 1.f / 16777216.f );
+    }
+
+private:
+    static uint64 mix(uint64 z) {
+        z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+        return z ^ ( z >> 31 );
+    }
+
+    uint64 state;
+    uint64 counter;
+};
 
 // Auxilary structure
 struct IntIndex {
@@ -29,20 +68,112 @@ struct IntIndex {
     }
 };
 
-struct DynamicFeature {
+// Sufficient statistics of the training pixels of one class on one side of a split:
+// their number and the sums of their offset vectors and of the squared norms of these
+struct SplitStats {
 
-    DynamicFeature() {}
+    SplitStats() : n(0), sx(0), sy(0), sz(0), sq(0) {}
 
-    std::pair< Eigen::Vector3d, Eigen::Vector3d > disVectorInQueryPixelCordinate;
-    std::pair< Eigen::Vector3d, Eigen::Vector3d > tempDisVectorInQueryPixelCordinate;
-    std::pair< Eigen::Quaterniond, Eigen::Quaterniond > pointPairTransformation;
+    void add(const cv::Point3f& v) {
+        ++n;
+        sx += v.x;
+        sy += v.y;
+        sz += v.z;
+        sq += v.x*v.x + v.y*v.y + v.z*v.z;
+    }
+    void add(const SplitStats& s) {
+        n += s.n;
+        sx += s.sx;
+        sy += s.sy;
+        sz += s.sz;
+        sq += s.sq;
+    }
+    void remove(const cv::Point3f& v) {
+        --n;
+        sx -= v.x;
+        sy -= v.y;
+        sz -= v.z;
+        sq -= v.x*v.x + v.y*v.y + v.z*v.z;
+    }
+    void subtract(const SplitStats& s) {
+        n -= s.n;
+        sx -= s.sx;
+        sy -= s.sy;
+        sz -= s.sz;
+        sq -= s.sq;
+    }
 
-    std::pair< Eigen::Matrix3d, Eigen::Matrix3d > firstQuerytoCameraTransformation;
+    // sum of the squared distances of the offsets to their mean
+    double scatter() const {
+        return n > 0 ? sq - (sx*sx + sy*sy + sz*sz) / n : 0;
+    }
 
-    std::pair< Eigen::Quaterniond, Eigen::Quaterniond > transformationMatrixOQuery_at_current_node;
+    int n;
+    double sx, sy, sz, sq;
+};
 
-    std::vector< std::pair < float, float > > alpha;
+// Sufficient statistics of the object orientations of the training pixels of one class on one side of a split:
+// their number and the sums of the outer products q q^T of their quaternions (upper triangle, row by row)
+struct RotationStats {
+
+    RotationStats() : n(0) {
+        for( int k = 0; k < 10; ++k )
+            m[ k ] = 0;
+    }
 
+    void add(const cv::Vec4f& q) {
+        ++n;
+        accumulate( q, 1.0 );
+    }
+    void add(const RotationStats& s) {
+        n += s.n;
+        for( int k = 0; k < 10; ++k )
+            m[ k ] += s.m[ k ];
+    }
+    void remove(const cv::Vec4f& q) {
+        --n;
+        accumulate( q, -1.0 );
+    }
+    void subtract(const RotationStats& s) {
+        n -= s.n;
+        for( int k = 0; k < 10; ++k )
+            m[ k ] -= s.m[ k ];
+    }
+
+    // sum of 1 - (q.q_mean)^2 over the quaternions, i.e. of the squared sine of half the angle to the mean
+    // rotation. The mean q_mean is the eigenvector of the largest eigenvalue of the sum of the outer products,
+    // and this eigenvalue is the sum of (q.q_mean)^2, so one eigen decomposition gives the spread
+    double dispersion() const {
+
+        if( n <= 0 )
+            return 0;
+
+        Eigen::Matrix4d M;
+        for( int i = 0, k = 0; i < 4; ++i )
+            for( int j = i; j < 4; ++j, ++k )
+                M( i, j ) = M( j, i ) = m[ k ];
+
+        Eigen::SelfAdjointEigenSolver< Eigen::Matrix4d > solver( M, Eigen::EigenvaluesOnly );
+        return std::max( 0.0, n - solver.eigenvalues()( 3 ) );
+    }
+
+    void accumulate(const cv::Vec4f& q, double w) {
+        for( int i = 0, k = 0; i < 4; ++i )
+            for( int j = i; j < 4; ++j, ++k )
+                m[ k ] += w * q[ i ] * q[ j ];
+    }
+
+    int n;
+    double m[ 10 ];
+};
+
+// An open node of the level-wise tree growth, its training pixels of class l are the range
+// [begin[l], end[l]) of the permutation of class l of the tree
+struct GrowNode {
+    int size( int l ) const { return end[ l ] - begin[ l ]; }
+
+    int node;
+    std::vector< int > begin, end;
 };
 
 // Structure for the leafs
@@ -145,7 +276,7 @@ class CRTree {
 public:
     // Constructors
     CRTree(const char* filename, bool& success);
-    CRTree(int min_s, int max_d, int l, cv::RNG* pRNG) : min_samples(min_s), max_depth(max_d), num_leaf(0), num_nodes(1), num_labels(l), cvRNG(pRNG) {
+    CRTree(int min_s, int max_d, int l, const StreamRNG& treeRNG) : min_samples(min_s), max_depth(max_d), num_leaf(0), num_nodes(1), num_labels(l), rng(treeRNG), node_threads(1), trainingData(NULL) {
 
         nodes.resize(int(num_nodes));
         nodes[0].isLeaf = false;
@@ -213,6 +344,11 @@ public:
         training_mode = mode;
     }
 
+    // threads splitting the nodes of a level and evaluating the tests of a big node in parallel
+    void setNodeThreads(int threads) {
+        node_threads = std::max(1, threads);
+    }
+
     bool GetHierarchy( std::vector< HNode > &h ) {
         if ( (hierarchy.size() == 0) ) { // check if the hierarchy is set at all(hierarchy == NULL) ||
             return false;
@@ -225,31 +361,65 @@ public:
     int regression(const std::vector<cv::Mat> &vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, cv::Point &pt, float &scale) const;
 
     // Training
-    void growTree( const Parameters& param,  const CRPixel& TrData, int samples, int trNr, std::vector< std::vector< int > > numbers );
+    // numbers holds the indices of the training pixels of each class used by the tree, it is taken over by the tree (swapped)
+    void growTree( const Parameters& param,  const CRPixel& TrData, int samples, int trNr, std::vector< std::vector< int > >& numbers );
+
+    // time the split measures on the training pixels against the reference measures, sweepMisses counts the sweeps
+    // whose best split is worse than the best random threshold by more than tolerance
+    void benchmarkMeasures(const Parameters& param, const CRPixel& TrData, int tests, double tolerance, double& referenceTime, double& statsTime, double& sweepTime, double& maxDifference, int& sweepMisses);
+
+    // grow the training sets of a tree to depth with random splits, once with the sets of each node copied into
+    // its children (copy) and once in place on the permutation (inPlace); the times are those of the splits, the
+    // memory is the growth of the peak resident memory. False if both do not give the same nodes
+    bool benchmarkSets(const Parameters& param, const CRPixel& TrData, const std::vector< std::vector< int > >& numbers, int depth, double& copyTime, double& copyMemory, double& inPlaceTime, double& inPlaceMemory);
 
     // IO functions
     bool saveTree(const char* filename) const;
     bool loadHierarchy(const char* filename);
-    std::vector< std::vector<DynamicFeature*> > dynFeatureSet;
 
 private:
 
     // Private functions for training
-    void grow(const Parameters& param, const vector< vector< PixelFeature*> >& TrainSet, vector<vector< DynamicFeature*> >& dynFeatures, const vector<vector<int> >& TrainIDs, int node, unsigned int depth, int samples, vector<float>& vRatio, int trNr) ;
+    void grow(const Parameters& param, int samples, vector<float>& vRatio, int trNr) ;
+
+    bool splitNode(const Parameters& param, GrowNode& open, GrowNode& childA, GrowNode& childB, int* test, unsigned int depth, int samples, const vector<float>& vRatio, int trNr, int threads);
+
+    int getStatSet(const GrowNode& open, int* stat);
 
-    int getStatSet(const std::vector<std::vector< PixelFeature*> >& TrainSet, int* stat);
+    void makeLeaf(const GrowNode& leaf, std::vector<float>& vRatio, int node);
 
-    void makeLeaf(const std::vector<std::vector< PixelFeature*> >& TrainSet, const std::vector<std::vector< DynamicFeature*> >& dynFeatures, const std::vector<std::vector< int> >& TrainIDs, std::vector<float>& vRatio, int node);
+    bool optimizeTest(const Parameters& param, GrowNode& open, GrowNode& childA, GrowNode& childB, int* test, unsigned int iter, unsigned int measure_mode,const std::vector<float>& vRatio, StreamRNG& nodeRNG, int threads);
 
-    bool optimizeTest(const Parameters& param, vector<vector< PixelFeature*> >& SetA, vector<vector< PixelFeature*> >& SetB, vector<vector< DynamicFeature*> >& dynA, vector<vector< DynamicFeature*> >& dynB, vector<vector<int> >& idA, vector<vector<int> >& idB , const vector<vector<  PixelFeature*> >& TrainSet, vector<vector<  DynamicFeature*> >& dynFeatures, const vector<vector<int> >& TrainIDs , int* test, unsigned int iter, unsigned int measure_mode,const std::vector<float>& vRatio, int node);
+    void generateTest(const Parameters& p, int* test, unsigned int max_w, unsigned int max_h, unsigned int max_c, StreamRNG& rng);
 
-    void generateTest(const Parameters& p, int* test, unsigned int max_w, unsigned int max_h, unsigned int max_c);
+    // values of a test for the n pixels samples of class l
+    void evaluateTest( std::vector<IntIndex>& values, const int* test, int l, const int* samples, int n, bool sortValues = true);
 
-    void evaluateTest( std::vector<std::vector<IntIndex> >& valSet, const int* test, const std::vector< std::vector< PixelFeature*> >& TrainSet, std::vector<std::vector< DynamicFeature*> >& dynFeatures, int node,  bool addPoseMeasure);
+    bool optimizeThresholdSweep(const std::vector<std::vector<IntIndex> >& valSet, const std::vector<std::vector< int> >& TrainSet, unsigned int measure_mode, bool pose, const std::vector<float>& vRatio, double& bestDist, int& threshold);
 
-    void split(vector< std::vector< PixelFeature* > >& SetA, vector< std::vector< PixelFeature* > >& SetB, vector< std::vector< DynamicFeature* > >& dynA, vector< std::vector< DynamicFeature* > >& dynB, vector< std::vector< int > >& idA, vector< std::vector< int > >& idB, const vector< std::vector< PixelFeature* > >& TrainSet, vector< std::vector< DynamicFeature* > >& dynFeatures, const vector< std::vector< int > >& TrainIDs, const vector< vector< IntIndex > >& valSet, int t);
+    bool optimizeThreshold(int bins, const std::vector<std::vector<IntIndex> >& valSet, const std::vector<std::vector< int> >& TrainSet, int vmin, int vmax, unsigned int measure_mode, bool pose, const std::vector<float>& vRatio, double& bestDist, int& threshold);
 
-    double measureSet( const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB,  const std::vector<std::vector< DynamicFeature*> >& dynA, const std::vector<std::vector< DynamicFeature*> >& dynB, unsigned int mode, const std::vector<float>& vRatio, bool addPoseMeasure) {
+    void split(vector< std::vector< int > >& SetA, vector< std::vector< int > >& SetB, const vector< std::vector< int > >& TrainSet, const vector< vector< IntIndex > >& valSet, int t);
+
+    void partition(const GrowNode& open, vector< vector< IntIndex > >& valSet, int t, GrowNode& childA, GrowNode& childB);
+
+    int benchmarkThreshold(const Parameters& param, int id, const std::vector< const int* >& samples, const std::vector< int >& sizes, std::vector< std::vector< IntIndex > >& valSet);
+
+    double measureSet( const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB, unsigned int mode, const std::vector<float>& vRatio, bool addPoseMeasure) {
+
+        // calculate pose measure
+        if( addPoseMeasure && mode == 1 )
+            return -orientationMeanMC( SetA, SetB );
+
+        // the other measures only need the statistics of the classes
+        std::vector< SplitStats > statA, statB;
+        setStats( SetA, statA );
+        setStats( SetB, statB );
+        return measureStats( statA, statB, mode, vRatio );
+    }
+
+    // measureSet computed directly on the sets without the pose measure, kept as reference for the statistics
+    double measureSetReference( const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB, unsigned int mode, const std::vector<float>& vRatio) {
 
         if ( mode == 0 || mode == -1 ) {
 
@@ -269,44 +439,94 @@ private:
             }
         } else {
 
-            // check if pose measure is true
-            if( addPoseMeasure ) {
-                if( mode == 1 )
-                    // calculate pose measure
-                    return -orientationMeanMC( SetA, SetB , dynA, dynB);
-                else {
+            if ( training_mode == 2 || training_mode == 0 ) {
+                return -distMean( SetA, SetB );
+            } else {
+                return -distMeanMC( SetA, SetB );
+            }
+
+        }// end of if else for mode
+    }
+
+    // statistics of each class of a set in one pass
+    void setStats( const std::vector<std::vector< int> >& Set, std::vector< SplitStats >& stat ) const {
+
+        stat.assign( Set.size(), SplitStats() );
+        for( unsigned int l = 0; l < Set.size(); ++l )
+            for( std::vector< int >::const_iterator it = Set[l].begin(); it != Set[l].end(); ++it )
+                stat[l].add( sampleOffset( l, *it ) );
+    }
+
+    // orientation statistics of the object classes of a set, the other classes stay empty
+    void setRotationStats( const std::vector<std::vector< int> >& Set, std::vector< RotationStats >& stat ) const {
+
+        stat.assign( Set.size(), RotationStats() );
+        for( unsigned int l = 0; l < Set.size(); ++l )
+            if( class_id[ l ] > 0 )
+                for( std::vector< int >::const_iterator it = Set[l].begin(); it != Set[l].end(); ++it )
+                    stat[l].add( sampleOrientation( l, *it ) );
+    }
+
+    // measureSet on the statistics of the classes in both sets, the pose measure is orientationMeanStats
+    double measureStats( const std::vector< SplitStats >& statA, const std::vector< SplitStats >& statB, unsigned int mode, const std::vector<float>& vRatio) {
+
+        if ( mode == 0 || mode == -1 ) {
+
+            if ( training_mode == 0 || training_mode == 2 ) {
+                return InfGainStats( statA, statB, vRatio, false );
 
-                    if ( training_mode == 2 || training_mode == 0 ) {
-                        return -distMean( SetA, SetB );
-                    } else {
-                        return -distMeanMC( SetA, SetB );
-                    }
-                }
+            } else if( training_mode == 1 ) {
+                return InfGainStats( statA, statB, vRatio, true ) + InfGainStats( statA, statB, vRatio, false ) / double( statA.size() );
 
             } else {
+                std::cerr << " there is no method associated with the training mode: " << training_mode << std::endl;
+                return -1;
 
-                if ( training_mode == 2 || training_mode == 0 ) {
-                    return -distMean( SetA, SetB );
-                } else {
-                    return -distMeanMC( SetA, SetB );
-                }
+            }
+        } else {
 
+            if ( training_mode == 2 || training_mode == 0 ) {
+                return -distMeanStats( statA, statB );
+            } else {
+                return -distMeanMCStats( statA, statB );
             }
+        }
+    }
 
-        }// end of if else for mode
+    // offset of the training pixel i of class l
+    const cv::Point3f& sampleOffset( int l, int i ) const {
+        return trainingData->samples[ l ].offset[ i ];
     }
 
-    double distMean(const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB);
+    // orientation of the object seen from the training pixel i of class l, w x y z
+    const cv::Vec4f& sampleOrientation( int l, int i ) const {
+        return trainingData->samples[ l ].orientation[ i ];
+    }
 
-    double distMeanMC(const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB);
+    // pixels of class l of a node, in the order of the permutation
+    const int* nodeSamples( const GrowNode& open, int l ) const {
+        return open.size( l ) > 0 ? &sampleOrder[ l ][ open.begin[ l ] ] : NULL;
+    }
 
-    double orientationMeanMC(const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB, const std::vector<std::vector< DynamicFeature*> >& dynA, const std::vector<std::vector< DynamicFeature*> >& dynB);
+    double distMean(const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB);
 
-    double distMeanMC_pose(const vector< vector< PixelFeature* > >& SetA, const vector<vector< PixelFeature* > >& SetB) ;
+    double distMeanMC(const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB);
 
-    double InfGain(const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB, const std::vector<float>& vRatio);
+    double orientationMeanMC(const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB);
 
-    double InfGainBG(const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB, const std::vector<float>& vRatio);
+    double distMeanMC_pose(const vector< vector< int > >& SetA, const vector<vector< int > >& SetB) ;
+
+    double InfGain(const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB, const std::vector<float>& vRatio);
+
+    double InfGainBG(const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB, const std::vector<float>& vRatio);
+
+    double distMeanStats(const std::vector< SplitStats >& statA, const std::vector< SplitStats >& statB);
+
+    double distMeanMCStats(const std::vector< SplitStats >& statA, const std::vector< SplitStats >& statB);
+
+    double orientationMeanStats(const std::vector< RotationStats >& rotA, const std::vector< RotationStats >& rotB);
+
+    double InfGainStats(const std::vector< SplitStats >& statA, const std::vector< SplitStats >& statB, const std::vector<float>& vRatio, bool background);
 
 
     // Data structure
@@ -348,7 +568,18 @@ private:
 
     // hierarchy as vector
     std::vector<HNode> hierarchy;
-    cv::RNG *cvRNG;
+
+    // random stream of the tree, each node draws from the stream of its id
+    StreamRNG rng;
+
+    int node_threads;
+
+    // training pixels the sets of the training refer to by index
+    const CRPixel* trainingData;
+
+    // permutation of the indices of the training pixels of each class while the tree is grown,
+    // the pixels of a node are a range of it
+    std::vector< std::vector< int > > sampleOrder;
 };
 
 inline int CRTree::regression(const std::vector<cv::Mat> &vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, cv::Point &pt, float &scale) const {
@@ -421,32 +652,32 @@ inline int CRTree::regression(const std::vector<cv::Mat> &vImg, const pcl::Point
     return nodes[node].leftChild;
 }
 
-inline void CRTree::generateTest(const Parameters& p, int* test, unsigned int max_w, unsigned int max_h, unsigned int max_c) {
+inline void CRTree::generateTest(const Parameters& p, int* test, unsigned int max_w, unsigned int max_h, unsigned int max_c, StreamRNG& rng) {
     //	cv::Point pt1, pt2;
 
     float scale_factor = 0.8f;
 
-    test[ 0 ] = cvRNG->operator ()( max_w * scale_factor ) - max_w * scale_factor / 2.0f;
-    test[ 1 ] = cvRNG->operator ()( max_h * scale_factor ) - max_h * scale_factor / 2.0f;
-    test[ 2 ] = cvRNG->operator ()( max_w * scale_factor ) - max_w * scale_factor / 2.0f;
-    test[ 3 ] = cvRNG->operator ()( max_h * scale_factor ) - max_h * scale_factor / 2.0f;
+    test[ 0 ] = rng( max_w * scale_factor ) - max_w * scale_factor / 2.0f;
+    test[ 1 ] = rng( max_h * scale_factor ) - max_h * scale_factor / 2.0f;
+    test[ 2 ] = rng( max_w * scale_factor ) - max_w * scale_factor / 2.0f;
+    test[ 3 ] = rng( max_h * scale_factor ) - max_h * scale_factor / 2.0f;
 
     if( p.addSurfel && p.addIntensity )
-        test[ 4 ] = cvRNG->operator ()( max_c + 4 );  //max_c  + 4 dimension for surfel feature
+        test[ 4 ] = rng( max_c + 4 );  //max_c  + 4 dimension for surfel feature
     else if(!p.addSurfel && p.addIntensity)
-        test[ 4 ] = cvRNG->operator ()( max_c ) ;
+        test[ 4 ] = rng( max_c ) ;
     else if( p.addSurfel && !p.addIntensity )
-        test[ 4 ] = cvRNG->operator()(max_c + 4 -1) +1;
+        test[ 4 ] = rng(max_c + 4 -1) +1;
     else
-        test[ 4 ] = cvRNG->operator()( max_c - 1) + 1;
+        test[ 4 ] = rng( max_c - 1) + 1;
 
 }
 
-inline int CRTree::getStatSet(const std::vector<std::vector< PixelFeature*> >& TrainSet, int* stat) {
+inline int CRTree::getStatSet(const GrowNode& open, int* stat) {
 
     int count = 0;
-    for( unsigned int l = 0; l < TrainSet.size(); ++l ) {
-        if( TrainSet[l].size() > 0 )
+    for( unsigned int l = 0; l < open.begin.size(); ++l ) {
+        if( open.size( l ) > 0 )
             stat[ count++ ] = l;
     }
     return count;
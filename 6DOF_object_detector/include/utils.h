@@ -87,6 +87,9 @@ void selectConvexHull( const cv::Mat& img_rgb, const pcl::PointCloud< pcl::Point
 
 void selectPlane( const cv::Mat& img_rgb, const pcl::PointCloud< pcl::PointXYZRGB >::Ptr& cloud, Eigen::Matrix4d& referenceTransform, std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > &convexHull_, Plane &table_plane ) ;
 
+// RANSAC fit of the dominant plane of the depth image without user interaction, planeMask marks the pixels on the plane
+bool segmentDominantPlane( const cv::Mat& depthImg, float inlierThreshold, cv::Mat& planeMask, Plane& plane, int iterations = 100, int step = 4, float minSupport = 0.1f );
+
 void getObjectPointCloud( const pcl::PointCloud< pcl::PointXYZRGB >::ConstPtr& cloud, float minHeight, float maxHeight, std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > convexHull, Plane &table_plane, Eigen::Vector3d turnTable_center, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &objectCloud  ) ;
 
 Eigen::Vector3d getTurnTableCenter( const cv::Mat& img_rgb, const pcl::PointCloud< pcl::PointXYZRGB >::Ptr& cloud, Eigen::Matrix4d& referenceTransform, Plane &table_plane ) ;
@@ -102,3 +105,13 @@ void createWireFrame (cv::Mat &img, std::vector<cv::Point2f> &vertices);
 void  getLine( pcl::PointXYZRGB  &p,  Line&line);
 
 void getLinePlaneIntersection(Line &line, Plane &plane, Eigen::Vector3d &ptIntersection);
+
+// peak resident memory of the process in MB (VmHWM of /proc/self/status), 0 if it is not available
+double peakMemory();
+
+// resident memory of the process in MB (VmRSS of /proc/self/status), 0 if it is not available
+double currentMemory();
+
+// restart the peak resident memory at the current one (/proc/self/clear_refs, Linux 4.0 and later),
+// false if it could not be reset
+bool resetPeakMemory();
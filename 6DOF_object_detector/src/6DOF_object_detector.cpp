@@ -73,6 +73,7 @@
 #include <stdexcept>
 
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -84,6 +85,51 @@
 
 using namespace std;
 
+// load an optional config entry, the name is taken from its comment line
+bool loadOption( Parameters& p, const string& name, istream& in ) {
+
+    if( name == "smoothPoseSpace" )
+        in >> p.smoothPoseSpace;
+    else if( name == "leafGroupedVoting" )
+        in >> p.leafGroupedVoting;
+    else if( name == "frameBudget" )
+        in >> p.frameBudget;
+    else if( name == "voteBudget" )
+        in >> p.voteBudget;
+    else if( name == "cascadeTrees" )
+        in >> p.cascadeTrees;
+    else if( name == "cascadeThreshold" )
+        in >> p.cascadeThreshold;
+    else if( name == "cascadeRecall" )
+        in >> p.cascadeRecall;
+    else if( name == "depthGating" )
+        in >> p.depthGating;
+    else if( name == "coarseStride" )
+        in >> p.coarseStride;
+    else if( name == "coarseRelax" )
+        in >> p.coarseRelax;
+    else if( name == "planeThreshold" )
+        in >> p.planeThreshold;
+    else if( name == "trackingInterval" )
+        in >> p.trackingInterval;
+    else if( name == "trackingMargin" )
+        in >> p.trackingMargin;
+    else if( name == "houghDecay" )
+        in >> p.houghDecay;
+    else if( name == "houghSubset" )
+        in >> p.houghSubset;
+    else if( name == "motionReset" )
+        in >> p.motionReset;
+    else if( name == "thresholdBins" )
+        in >> p.thresholdBins;
+    else if( name == "rngSeed" )
+        in >> p.rngSeed;
+    else
+        return false;
+
+    return true;
+}
+
 // load config file for dataset
 void loadConfig( string& filename, int mode,  Parameters& p ) {
 
@@ -258,6 +304,17 @@ void loadConfig( string& filename, int mode,  Parameters& p ) {
         in >> p.addPoseScore;
         in.getline( buffer, 1000 );
 
+        // optional entries, given as "# name" followed by the value, parameters not listed keep their default
+        while( in.getline( buffer, 1000 ) ) {
+            string name( buffer );
+            size_t first = name.find_first_not_of( "# " );
+            if( name.empty() || name[ 0 ] != '#' || first == string::npos )
+                continue;
+            name = name.substr( first, name.find_last_not_of( " \t\r" ) + 1 - first );
+            if( !loadOption( p, name, in ) )
+                cerr << "Unknown config entry " << name << endl;
+            in.getline( buffer, 1000 );
+        }
 
     } else {
         cerr << "Config file not found " << filename << endl;
@@ -267,6 +324,7 @@ void loadConfig( string& filename, int mode,  Parameters& p ) {
 
     switch ( mode ) {
     case 0:
+    case 5:
         cout << endl << "------------------------------------" << endl << endl;
         cout << "Training:         " << p.objectName << endl;
         cout << "Trees:            " << p.ntrees << " " << endl;
@@ -445,6 +503,39 @@ void loadRawData( rawData& data, Parameters& p ) {
 
 }
 
+// set the class labels for the training mode, returns the training mode of the forest
+int setTrainingLabels( Parameters& p ) {
+
+    // depending on the training mode you should change the class_structure
+    if ( p.training_mode == 0 ) {
+        std::cout<< " the class labels have kept the way they are"<< std::endl;
+    } else {
+        // only keep the label of the background class as 0 and the rest should just get labelled differntly
+        std::cout << " the class labels have changed: the background class(with label 0) is kept and all other classes have assigned different labels according to their rank in the training file" << std::endl;
+        // first check if there are only 0 and 1 in the class_structure
+        bool binary = true;
+        for ( unsigned int i = 0; i < p.class_structure.size() ; i++ ) {
+            if ( p.class_structure[ i ] > 1 || p.class_structure[ i ] < 0 )
+                binary = false;
+        }
+        if ( binary ) {
+            int count =1;
+            std::cout << " new class labels: " << std::endl;
+            for ( unsigned int i=0; i < p.class_structure.size(); i++ ) {
+                if ( p.class_structure[ i ] !=0 ) {
+                    p.class_structure[ i ] = count;
+                    count++;
+                }
+                std::cout << " label: " << i << " " << p.class_structure[ i ] << std::endl;
+            }
+        } else {
+            std::cout<< " there are two classes only, training mode changed to 0 " << std::endl;
+            return 0;
+        }
+    }
+    return p.training_mode;
+}
+
 // Init and start training
 void run_train( Parameters& p ) {
 
@@ -484,38 +575,150 @@ void run_train( Parameters& p ) {
 
     cout << "after loading data " << p.trainclasspath << endl;
 
-    crForest.training_mode = p.training_mode;
+    crForest.training_mode = setTrainingLabels( p );
 
-    // depending on the training mode you should change the class_structure
-    if ( p.training_mode == 0 ) {
-        std::cout<< " the class labels have kept the way they are"<< std::endl;
-    } else {
-        // only keep the label of the background class as 0 and the rest should just get labelled differntly
-        std::cout << " the class labels have changed: the background class(with label 0) is kept and all other classes have assigned different labels according to their rank in the training file" << std::endl;
-        // first check if there are only 0 and 1 in the class_structure
-        bool binary = true;
-        for ( unsigned int i = 0; i < p.class_structure.size() ; i++ ) {
-            if ( p.class_structure[ i ] > 1 || p.class_structure[ i ] < 0 )
-                binary = false;
-        }
-        if ( binary ) {
-            int count =1;
-            std::cout << " new class labels: " << std::endl;
-            for ( unsigned int i=0; i < p.class_structure.size(); i++ ) {
-                if ( p.class_structure[ i ] !=0 ) {
-                    p.class_structure[ i ] = count;
-                    count++;
-                }
-                std::cout << " label: " << i << " " << p.class_structure[ i ] << std::endl;
-            }
-        } else {
-            std::cout<< " there are two classes only, training mode changed to 0 " << std::endl;
-            crForest.training_mode = 0;
+    // Train forest
+    crForest.trainForest( p, data, 20, 2000);
+}
+
+// time the split measures of the training on the training pixels (mode 5), false if the measures on the
+// statistics or the threshold sweeps do not match the reference measures
+bool benchmarkTraining( Parameters& p ) {
+
+    std::cout << "entering training benchmark "<< std::endl;
+
+    rawData data;
+    loadRawData(data, p);
+
+    // the labels may fall back to two classes, the benchmark uses the training mode of the training
+    int training_mode = setTrainingLabels( p );
+
+    // fixed seed to time the same tests in every run
+    cv::RNG pRNG( p.rngSeed );
+    CRPixel TrData( &pRNG );
+    TrData.setClasses( p.nlabels );
+    CRForestTraining::extract_Pixels( data, p, TrData, &pRNG );
+
+    CRTree tree( 20, p.treedepth, TrData.samples.size(), StreamRNG( p.rngSeed ) );
+    tree.setClassId( p.class_structure );
+    tree.setTrainingMode( training_mode );
+    tree.setObjectSize( p.objectSize );
+
+    int tests = 200;
+    double tolerance = 1e-6;
+    double referenceTime, statsTime, sweepTime, maxDifference;
+    int sweepMisses;
+    tree.benchmarkMeasures( p, TrData, tests, tolerance, referenceTime, statsTime, sweepTime, maxDifference, sweepMisses );
+
+    // the training sets of a tree with all training pixels, split with copies into new sets per node as before
+    // and in place on the permutation of the tree
+    vector< vector< int > > numbers( TrData.samples.size() );
+    for( unsigned int l = 0; l < numbers.size(); l++ )
+        for( unsigned int j = 0; j < TrData.samples[ l ].size(); j++ )
+            numbers[ l ].push_back( j );
+    double copyTime, copyMemory, inPlaceTime, inPlaceMemory;
+    bool sameNodes = tree.benchmarkSets( p, TrData, numbers, p.treedepth, copyTime, copyMemory, inPlaceTime, inPlaceMemory );
+
+    bool passed = maxDifference <= tolerance && sweepMisses == 0 && sameNodes;
+
+    cout << endl << "------------------------------------" << endl << endl;
+    cout << "Tests:                " << tests << ", 10 thresholds each, classification and regression" << endl;
+    cout << "\t Time for reference measures..\t" << referenceTime << " sec" << endl;
+    cout << "\t Time for statistics measures.\t" << statsTime << " sec" << endl;
+    cout << "\t Time for threshold sweeps....\t" << sweepTime << " sec (all thresholds of each test)" << endl;
+    cout << "\t Max. relative difference.....\t" << maxDifference << " (tolerance " << tolerance << ")" << endl;
+    cout << "\t Sweeps below random threshold\t" << sweepMisses << endl;
+    cout << endl;
+    cout << "Training sets of a tree of depth " << p.treedepth << " with random splits" << endl;
+    cout << "\t Time for copied sets.........\t" << copyTime << " sec, peak memory +" << copyMemory << " MB" << endl;
+    cout << "\t Time for in place sets.......\t" << inPlaceTime << " sec, peak memory +" << inPlaceMemory << " MB" << endl;
+    cout << "\t Same nodes...................\t" << ( sameNodes ? "yes" : "no" ) << endl;
+    cout << "\t Result.......................\t" << ( passed ? "PASS" : "FAIL" ) << endl;
+    cout << endl << "------------------------------------" << endl << endl;
+
+    return passed;
+}
+
+// load a test image and its depth image
+bool loadTestImage( const Parameters& p, const string& name, cv::Mat& img, cv::Mat& depthImg ) {
+
+    img = cv::imread(( p.testimagepath + "/" + name ).c_str(),CV_LOAD_IMAGE_COLOR);
+    if(img.empty()) {
+        cout << "Could not load image file: " << ( p.testimagepath + "/" + name ).c_str() << endl;
+        return false;
+    }
+    else
+        cout << "loaded image file: " << ( p.testimagepath + "/" + name ).c_str() << endl;
+
+    // Load Depth Image
+    string filename = name;
+    int size_of_string = name.size();
+    filename.replace( size_of_string - 4, 15, "_filleddepth.png" );
+    depthImg = cv::imread( ( p.testimagepath + "/" + filename ).c_str(),CV_LOAD_IMAGE_ANYDEPTH );
+    if( depthImg.empty() ) {
+
+        cout << "Could not load image file: " << ( p.testimagepath + "/" + filename ).c_str() << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// mask of the pixels which are matched to the forest, the same for all classes (empty if all pixels are matched)
+void buildGate( const Parameters& p, const cv::Mat& depthImg, cv::Mat& gate ) {
+
+    gate.release();
+
+    // pixels which can not vote for a center in the range of the scales
+    if( p.depthGating ) {
+        CRForestDetector::depthGate(depthImg, p.scales, p.vbbSize, gate);
+        cout << "\t depth gate passed " << 100.f * cv::countNonZero(gate) / float(gate.rows * gate.cols) << "% of the pixels" << endl;
+    }
+
+    // pixels on the dominant support plane
+    if( p.planeThreshold > 0 ) {
+
+        int64 tickStart = cv::getTickCount();
+        cv::Mat planeMask;
+        Plane plane;
+        if( segmentDominantPlane( depthImg, p.planeThreshold, planeMask, plane ) ) {
+            cv::Mat offPlane = ~planeMask;
+            if( gate.empty() )
+                gate = offPlane;
+            else
+                gate &= offPlane;
         }
+        cout << "\t Time for plane removal.......\t" << (double)(cv::getTickCount() - tickStart)/cv::getTickFrequency() << " sec, " << 100.f * cv::countNonZero(planeMask) / float(planeMask.rows * planeMask.cols) << "% of the pixels on the plane" << endl;
     }
+}
 
-    // Train forest
-    crForest.trainForest( p, data, 20, 2000);
+// regions of the tracked candidates in the next frame: the projections of their 3D bounding boxes enlarged by
+// trackingMargin on each side. regions[c] bounds the regions of class c, roiMask is the union of all regions
+void predictRegions( const Parameters& p, const vector< Candidate >& tracks, const cv::Size& imgSize, vector< cv::Rect >& regions, cv::Mat& roiMask ) {
+
+    cv::Size2f img_size( imgSize.width, imgSize.height );
+    cv::Rect imgRect( 0, 0, imgSize.width, imgSize.height );
+
+    regions.assign( p.nlabels, cv::Rect() );
+    roiMask = cv::Mat::zeros( imgSize, CV_8UC1 );
+
+    for( unsigned int t = 0; t < tracks.size(); t++ ) {
+
+        cv::Point3f bbSize = p.vbbSize[ tracks[ t ].c ];
+        Eigen::Matrix4d coordinateSystem = tracks[ t ].coordinateSystem;
+        std::vector< cv::Point2f > imagePoints;
+        create3DBB( bbSize, coordinateSystem, img_size, imagePoints );
+
+        cv::Rect box = cv::boundingRect( imagePoints );
+        int marginX = int( p.trackingMargin * box.width );
+        int marginY = int( p.trackingMargin * box.height );
+        box = cv::Rect( box.x - marginX, box.y - marginY, box.width + 2 * marginX, box.height + 2 * marginY ) & imgRect;
+        if( box.area() == 0 )
+            continue;
+
+        roiMask( box ).setTo( cv::Scalar( 255 ) );
+        regions[ tracks[ t ].c ] = regions[ tracks[ t ].c ].area() > 0 ? ( regions[ tracks[ t ].c ] | box ) : box;
+    }
 }
 
 void detect( Parameters& p, CRForestDetector& crDetect ) {
@@ -530,6 +733,10 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
     char buffer2[3000];
     char buffer3[3000];
 
+    // latencies of the frames detected in the tracked regions and of the full frames
+    double trackedLatency = 0, fullLatency = 0;
+    int nTracked = 0, nFull = 0;
+
     for ( unsigned int tcNr = 0; tcNr < vFilenames.size(); tcNr++ ) {
 
         // Create directory
@@ -551,6 +758,13 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
             p.file_test_num = p.test_num;
         }
 
+        // confirmed candidates of the last frame, the images of a test set are the frames of one sequence
+        vector< Candidate > tracks;
+        int frameNr = 0;
+
+        // frames accumulated in the temporal hough space since the last reset
+        int temporalFrame = 0;
+
         // Run detector for each image
         for( unsigned int i = p.off_test; (int)i < p.off_test + p.file_test_num; ++i) {
 
@@ -618,25 +832,37 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
             //////////////////////////// FROM HERE THE DETECTION STARTS///////////////////////////////////////////
             // Load image
 
-            cv::Mat img = cv::imread(( p.testimagepath + "/" + vFilenames[ tcNr ][ i ]).c_str(),CV_LOAD_IMAGE_COLOR);
-            if(img.empty()) {
-                cout << "Could not load image file: " << ( p.testimagepath + "/" + vFilenames[ tcNr ][ i ] ).c_str() << endl;
-                exit(-1);
-            }
-            else
-                cout << "loaded image file: " << ( p.testimagepath + "/" + vFilenames[ tcNr ][ i ] ).c_str() << endl;
-
-            // Load Depth Image
-            string filename = vFilenames[ tcNr ][ i ];
-            int size_of_string = vFilenames[ tcNr ][ i ].size();
-            filename.replace( size_of_string - 4, 15, "_filleddepth.png" );
-            cv::Mat depthImg = cv::imread( ( p.testimagepath + "/" + filename ).c_str(),CV_LOAD_IMAGE_ANYDEPTH );
-            if( depthImg.empty() ) {
-
-                cout << "Could not load image file: " << ( p.testimagepath + "/" + filename ).c_str() << endl;
+            cv::Mat img, depthImg;
+            if( !loadTestImage( p, vFilenames[ tcNr ][ i ], img, depthImg ) )
                 exit( -1 );
-            }
 
+            // the time budget of the frame starts after loading the images
+            crDetect.setDeadline( p.frameBudget );
+            int64 frameStart = cv::getTickCount();
+
+            // tracking: between the periodic full frame passes only the regions predicted from the tracked candidates are processed
+            bool tracked = p.trackingInterval > 0 && !tracks.empty() && frameNr % p.trackingInterval != 0;
+            frameNr++;
+
+            vector< cv::Rect > regions;
+            cv::Mat trackMask;
+            if( tracked )
+                predictRegions( p, tracks, img.size(), regions, trackMask );
+
+            // temporal hough space: it starts again for a new sequence or when the camera moved
+            int subsetStride = std::max( 1, p.houghSubset );
+            int subsetNr = 0;
+            if( p.houghDecay > 0 ) {
+                bool moved = crDetect.cameraMoved( depthImg, p.motionReset );
+                if( temporalFrame == 0 || moved ) {
+                    if( moved )
+                        cout << "\t camera moved, temporal hough space reset" << endl;
+                    crDetect.resetTemporalHough();
+                    temporalFrame = 0;
+                }
+                subsetNr = temporalFrame % ( subsetStride * subsetStride );
+                temporalFrame++;
+            }
 
             // preparing the variables
             int nlabels = crDetect.GetNumLabels();
@@ -656,17 +882,68 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
             int tstart = clock();
             vector<cv::Mat> vImg;
             pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
-            CRPixel::extractFeatureChannels(p, img, depthImg, vImg, normals);
+            if( tracked ) {
+                // the tests of the trees read the features up to 0.4 object sizes around a pixel
+                cv::Rect roi;
+                for (unsigned int cNr = 0; cNr < regions.size(); cNr++)
+                    if( regions[ cNr ].area() > 0 )
+                        roi = roi.area() > 0 ? ( roi | regions[ cNr ] ) : regions[ cNr ];
+                int border = int( 0.4f * std::max( p.objectSize.first, p.objectSize.second ) * p.scales.back() ) + 16;
+                CRPixel::extractFeatureChannels(p, img, depthImg, cv::Rect( roi.x - border, roi.y - border, roi.width + 2 * border, roi.height + 2 * border ), vImg, normals);
+            } else
+                CRPixel::extractFeatureChannels(p, img, depthImg, vImg, normals);
+
+            // local coordinate systems of the pixels used in pose voting
+            QueryFrames frames;
+            CRPixel::computeQueryFrames(depthImg, normals, frames);
             cout << "extracting feature channels\t\t" << (double)(clock() - tstart)/CLOCKS_PER_SEC << " sec" << endl;
 
             // 1.0 Assign the reached leaf
             tstart = clock();
-            vector<cv::Mat> vImgAssign;
-            crDetect.fullAssignCluster(img, depthImg, vImgAssign, vImg, normals);
+            // pixels which can not contain the object are not matched, the mask is the same for all classes
+            cv::Mat gate;
+            buildGate( p, depthImg, gate );
+
+            if( tracked ) {
+                if( gate.empty() )
+                    gate = trackMask;
+                else
+                    gate &= trackMask;
+            }
+
+            // pyramid detection: a coarse pass on a grid finds the regions, only these are matched at full resolution
+            if( p.coarseStride > 1 && !tracked ) {
+                int64 tickStart = cv::getTickCount();
+                cv::Mat roiMask;
+                crDetect.coarseRegions(img, depthImg, vImg, normals, gate, p, regions, roiMask);
+                gate = roiMask;
+                cout << "\t Time for coarse pass.........\t" << (double)(cv::getTickCount() - tickStart)/cv::getTickFrequency() << " sec, " << 100.f * cv::countNonZero(gate) / float(gate.rows * gate.cols) << "% of the pixels left" << endl;
+            }
+
+            // temporal hough space: the pixels are split into houghSubset x houghSubset interleaved grids, one grid per frame
+            bool subsampled = p.houghDecay > 0 && subsetStride > 1;
+            if( subsampled ) {
+                cv::Mat subset = cv::Mat::zeros( img.rows, img.cols, CV_8UC1 );
+                for( int y = subsetNr / subsetStride; y < img.rows; y += subsetStride )
+                    for( int x = subsetNr % subsetStride; x < img.cols; x += subsetStride )
+                        subset.at< uchar >( y, x ) = 255;
+                if( gate.empty() )
+                    gate = subset;
+                else
+                    gate &= subset;
+            }
+
+            cv::Mat imgAssign;
+            crDetect.fullAssignCluster(img, depthImg, imgAssign, vImg, normals, p.cascadeTrees, p.cascadeThreshold, gate);
 
             //1.1 Calculate confidance for each pixel beloging to the class
             vector<cv::Mat>  classConfidence;
-            crDetect.getClassConfidence(vImgAssign, classConfidence);
+            crDetect.getClassConfidence(imgAssign, classConfidence);
+
+            // the confidences of a pixel subset are scaled to those of all pixels
+            if( subsampled )
+                for (unsigned int cNr = 0; cNr < classConfidence.size(); cNr++)
+                    classConfidence[ cNr ] *= float( subsetStride * subsetStride );
 
             //debug
             if (p.DEBUG) {
@@ -709,7 +986,18 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
 
                 std::vector< Candidate > temp_candidates;
 
-                crDetect.detectObject( img, depthImg, vImg, normals, vImgAssign, classConfidence, p, this_class, temp_candidates);
+                // no region of this class was found in the coarse pass or tracked
+                bool focused = tracked || p.coarseStride > 1;
+                if( focused && regions[ cNr ].area() == 0 )
+                    continue;
+
+                // the time left of the frame is shared by the classes still to detect
+                crDetect.shareDeadline( nlabels - 1 - cNr );
+
+                crDetect.detectObject( img, depthImg, vImg, normals, imgAssign, classConfidence, frames, p, this_class, temp_candidates, focused ? &regions[ cNr ] : NULL );
+
+                if ( crDetect.getForestUsage() >= 0 )
+                    cout << "\t forest used for center voting\t" << crDetect.getForestUsage() << endl;
 
                 for (unsigned int candNr = 0; candNr < temp_candidates.size(); candNr++)
                     candidates.push_back(temp_candidates[candNr]);
@@ -736,6 +1024,24 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
             }
             std::cout << "number of candidates " << candidates.size()  << std::endl;
 
+            double latency = (double)(cv::getTickCount() - frameStart)/cv::getTickFrequency();
+            if( tracked ) {
+                trackedLatency += latency;
+                nTracked++;
+            } else {
+                fullLatency += latency;
+                nFull++;
+            }
+            cout << "\t frame latency (" << ( tracked ? "tracked" : "full frame" ) << ")\t" << latency << " sec" << endl;
+
+            // the confirmed candidates are tracked into the next frame
+            if( p.trackingInterval > 0 ) {
+                tracks.clear();
+                for (unsigned int candNr = 0; candNr < candidates.size(); candNr++)
+                    if( candidates[ candNr ].weight > p.thresh_bb )
+                        tracks.push_back( candidates[ candNr ] );
+            }
+
             /**********************************************************************************************************************************************/
 
             // printing the candidate file
@@ -798,13 +1104,268 @@ void detect( Parameters& p, CRForestDetector& crDetect ) {
             cv::imwrite(( p.bbpath + "/" + vFilenames[tcNr][i]).c_str(), copy_img);
 
             fp_boxes.close();
+            crDetect.setDeadline( 0 );
             cout << "Total Time for processing this image\t\t" << (double)(clock() - pstart)/CLOCKS_PER_SEC << " sec" << endl;
         }
     }
+
+    if( p.trackingInterval > 0 ) {
+        cout << endl << "------------------------------------" << endl << endl;
+        if( nFull > 0 )
+            cout << "Full frames:          " << nFull << ", " << fullLatency / nFull << " sec per frame" << endl;
+        if( nTracked > 0 )
+            cout << "Tracked frames:       " << nTracked << ", " << trackedLatency / nTracked << " sec per frame" << endl;
+        cout << endl << "------------------------------------" << endl << endl;
+    }
+}
+
+// Timing of the detection stages on the test images
+void benchmark( Parameters& p, CRForestDetector& crDetect ) {
+
+    std::cout << "entering benchmark "<< std::endl;
+
+    // the images are timed one by one, without the hough space of the past frames
+    p.houghDecay = 0;
+
+    // Load image names
+    vector< vector< string > > vFilenames;
+    loadTestClassFile(p, vFilenames);
+
+    int nImages = 0;
+    double totalPixelOrder = 0, totalLeafOrder = 0, totalFullFrame = 0, totalPyramid = 0;
+
+    for ( unsigned int tcNr = 0; tcNr < vFilenames.size(); tcNr++ ) {
+
+        if ( p.select_test_set > 0 && int(tcNr) != p.select_test_set)
+            continue;
+
+        int test_num = p.test_num < 0 ? int(vFilenames[tcNr].size()) - p.off_test : p.test_num;
+
+        for( unsigned int i = p.off_test; (int)i < p.off_test + test_num && i < vFilenames[tcNr].size(); ++i) {
+
+            cv::Mat img, depthImg;
+            if( !loadTestImage( p, vFilenames[ tcNr ][ i ], img, depthImg ) )
+                continue;
+
+            vector<cv::Mat> vImg;
+            pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
+            CRPixel::extractFeatureChannels(p, img, depthImg, vImg, normals);
+
+            cv::Mat gate;
+            buildGate( p, depthImg, gate );
+
+            cv::Mat imgAssign;
+            crDetect.fullAssignCluster(img, depthImg, imgAssign, vImg, normals, p.cascadeTrees, p.cascadeThreshold, gate);
+
+            vector<cv::Mat> classConfidence;
+            crDetect.getClassConfidence(imgAssign, classConfidence);
+
+            // voting for the center in pixel order and grouped by leafs
+            for ( int cNr = 0; cNr < int(crDetect.GetNumLabels()) - 1; cNr++) {
+
+                double pixelOrderTime, leafOrderTime;
+                float maxDifference;
+                crDetect.benchmarkCenterVoting(depthImg, normals, imgAssign, classConfidence, p, cNr, pixelOrderTime, leafOrderTime, maxDifference);
+
+                cout << "\t voting for center (class " << cNr << ")\t pixel order " << pixelOrderTime << " sec\t leaf order " << leafOrderTime << " sec\t max. difference " << maxDifference << endl;
+
+                totalPixelOrder += pixelOrderTime;
+                totalLeafOrder += leafOrderTime;
+            }
+
+            // end-to-end detection on the full frame against the coarse-to-fine detection
+            if( p.coarseStride > 1 ) {
+
+                QueryFrames frames;
+                CRPixel::computeQueryFrames(depthImg, normals, frames);
+
+                for( int pyramid = 0; pyramid < 2; pyramid++ ) {
+
+                    int64 tickStart = cv::getTickCount();
+
+                    cv::Mat roiMask = gate;
+                    vector< cv::Rect > regions;
+                    if( pyramid )
+                        crDetect.coarseRegions(img, depthImg, vImg, normals, gate, p, regions, roiMask);
+
+                    cv::Mat assign;
+                    crDetect.fullAssignCluster(img, depthImg, assign, vImg, normals, p.cascadeTrees, p.cascadeThreshold, roiMask);
+
+                    vector<cv::Mat> confidence;
+                    crDetect.getClassConfidence(assign, confidence);
+
+                    int nCandidates = 0;
+                    for ( int cNr = 0; cNr < int(crDetect.GetNumLabels()) - 1; cNr++) {
+
+                        if( pyramid && regions[ cNr ].area() == 0 )
+                            continue;
+
+                        vector< Candidate > candidates;
+                        crDetect.detectObject(img, depthImg, vImg, normals, assign, confidence, frames, p, cNr, candidates, pyramid ? &regions[ cNr ] : NULL);
+                        nCandidates += candidates.size();
+                    }
+
+                    double detectionTime = (cv::getTickCount() - tickStart) / cv::getTickFrequency();
+                    if( pyramid ) {
+                        cout << "\t coarse-to-fine detection\t" << detectionTime << " sec\t candidates " << nCandidates << endl;
+                        totalPyramid += detectionTime;
+                    } else {
+                        cout << "\t full frame detection\t" << detectionTime << " sec\t candidates " << nCandidates << endl;
+                        totalFullFrame += detectionTime;
+                    }
+                }
+            }
+
+            nImages++;
+        }
+    }
+
+    if( nImages > 0 ) {
+        cout << endl << "------------------------------------" << endl << endl;
+        cout << "Images:               " << nImages << endl;
+        cout << "Voting, pixel order:  " << totalPixelOrder / nImages << " sec per image" << endl;
+        cout << "Voting, leaf order:   " << totalLeafOrder / nImages << " sec per image" << endl;
+        if( p.coarseStride > 1 ) {
+            cout << "Detection, full:      " << totalFullFrame / nImages << " sec per image" << endl;
+            cout << "Detection, pyramid:   " << totalPyramid / nImages << " sec per image" << endl;
+        }
+        cout << endl << "------------------------------------" << endl << endl;
+    }
+}
+
+// Calibration of the tree cascade on the test images used as validation set: for each number of cascade trees and
+// threshold the recall of the foreground pixels and the estimated cost are reported. There are no pixel labels for the
+// test images, so the foreground decision of the full forest (estimate >= 0.5) is taken as reference.
+void calibrateCascade( Parameters& p, CRForestDetector& crDetect ) {
+
+    std::cout << "entering cascade calibration "<< std::endl;
+
+    // Load image names
+    vector< vector< string > > vFilenames;
+    loadTestClassFile(p, vFilenames);
+
+    int ntrees = crDetect.GetCRForest()->vTrees.size();
+    int nbins = 100;
+
+    // histograms of the foreground estimate of the first K trees, of all pixels and of the foreground pixels of the full forest
+    vector< vector< double > > histAll( ntrees, vector< double >( nbins, 0 ) );
+    vector< vector< double > > histPos( ntrees, vector< double >( nbins, 0 ) );
+    double nAll = 0, nPos = 0, assignTime = 0;
+    int nImages = 0;
+
+    for ( unsigned int tcNr = 0; tcNr < vFilenames.size(); tcNr++ ) {
+
+        if ( p.select_test_set > 0 && int(tcNr) != p.select_test_set)
+            continue;
+
+        int test_num = p.test_num < 0 ? int(vFilenames[tcNr].size()) - p.off_test : p.test_num;
+
+        for( unsigned int i = p.off_test; (int)i < p.off_test + test_num && i < vFilenames[tcNr].size(); ++i) {
+
+            cv::Mat img, depthImg;
+            if( !loadTestImage( p, vFilenames[ tcNr ][ i ], img, depthImg ) )
+                continue;
+
+            vector<cv::Mat> vImg;
+            pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
+            CRPixel::extractFeatureChannels(p, img, depthImg, vImg, normals);
+
+            int64 tickStart = cv::getTickCount();
+            cv::Mat imgAssign;
+            crDetect.fullAssignCluster(img, depthImg, imgAssign, vImg, normals);
+            assignTime += (cv::getTickCount() - tickStart) / cv::getTickFrequency();
+
+            cv::Mat full;
+            crDetect.foregroundEstimate(imgAssign, ntrees, full);
+
+            // only pixels with depth can vote
+            cv::Mat validDepth = depthImg > 0;
+            cv::Mat positive = (full >= 0.5f) & validDepth;
+            nAll += cv::countNonZero(validDepth);
+            nPos += cv::countNonZero(positive);
+
+            for ( int K = 1; K < ntrees; K++ ) {
+
+                cv::Mat estimate;
+                crDetect.foregroundEstimate(imgAssign, K, estimate);
+
+                for ( int y = 0; y < estimate.rows; y++ ) {
+                    const float* est = estimate.ptr<float>(y);
+                    const uchar* valid = validDepth.ptr<uchar>(y);
+                    const uchar* pos = positive.ptr<uchar>(y);
+                    for ( int x = 0; x < estimate.cols; x++ ) {
+                        if( !valid[x] )
+                            continue;
+                        int b = std::max( 0, std::min( int( est[x] * nbins ), nbins - 1 ) );
+                        histAll[K][b]++;
+                        if( pos[x] )
+                            histPos[K][b]++;
+                    }
+                }
+            }
+
+            nImages++;
+        }
+    }
+
+    if( nImages == 0 || nAll == 0 || nPos == 0 ) {
+        cout << "no foreground pixels found for the calibration" << endl;
+        return;
+    }
+
+    cout << endl << "------------------------------------" << endl << endl;
+    cout << "Images:               " << nImages << endl;
+    cout << "Assignment, full:     " << assignTime / nImages << " sec per image" << endl << endl;
+    cout << "trees\t threshold\t recall\t passed\t est. time per image" << endl;
+
+    int bestK = 0;
+    float bestThreshold = 0.f, bestRecall = 1.f;
+    double bestCost = 1.0;
+
+    for ( int K = 1; K < ntrees; K++ ) {
+
+        // the pixels with estimate >= b/nbins are those in the bins b ... nbins-1
+        double passAll = 0, passPos = 0;
+        bool found = false;
+        for ( int b = nbins - 1; b >= 0; b-- ) {
+
+            passAll += histAll[K][b];
+            passPos += histPos[K][b];
+
+            double recall = passPos / nPos;
+            double passed = passAll / nAll;
+            // each pixel is matched to the first K trees, only the passed pixels to the rest
+            double cost = ( K + passed * ( ntrees - K ) ) / ntrees;
+
+            if( b % 10 == 0 )
+                cout << K << "\t " << float(b) / nbins << "\t\t " << recall << "\t " << passed << "\t " << cost * assignTime / nImages << " sec" << endl;
+
+            // the highest threshold with enough recall is the cheapest for this K
+            if( !found && recall >= p.cascadeRecall ) {
+                found = true;
+                if( cost < bestCost ) {
+                    bestCost = cost;
+                    bestK = K;
+                    bestThreshold = float(b) / nbins;
+                    bestRecall = recall;
+                }
+            }
+        }
+    }
+
+    cout << endl;
+    if( bestK == 0 )
+        cout << "the full forest is the cheapest for a recall of " << p.cascadeRecall << endl;
+    else {
+        cout << "for a recall of " << p.cascadeRecall << " use (recall " << bestRecall << ", est. " << bestCost * assignTime / nImages << " sec per image)" << endl;
+        cout << "# cascadeTrees" << endl << bestK << endl;
+        cout << "# cascadeThreshold" << endl << bestThreshold << endl;
+    }
+    cout << endl << "------------------------------------" << endl << endl;
 }
 
 // Init and start detector
-void run_detect( Parameters& p ) {
+void run_detect( Parameters& p, int mode ) {
 
     // create treePath
     string output(p.outpath);
@@ -893,7 +1454,12 @@ void run_detect( Parameters& p ) {
     }
 
     // run detector
-    detect(p, crDetect);
+    if( mode == 3 )
+        benchmark(p, crDetect);
+    else if( mode == 4 )
+        calibrateCascade(p, crDetect);
+    else
+        detect(p, crDetect);
 }
 
 
@@ -926,6 +1492,24 @@ int main( int argc, char* argv[ ] ) {
         cout << "  [test_class] running the detection only on this class" << endl;
         cout << "  [test_set] running the detection on images only in one test set" << endl;
         cout << "  [test_scale] running the detection only at this scale instead of all scales" << endl;
+        cout << endl << endl;
+
+        cout << "Benchmark "<<endl;
+        cout << "  mode = 3; " << std::endl;
+        cout << "  arguments: same as for the detection" << std::endl;
+        cout << "  times the stages of the detection on the test images instead of writing detections" << endl;
+        cout << endl << endl;
+
+        cout << "Cascade calibration "<<endl;
+        cout << "  mode = 4; " << std::endl;
+        cout << "  arguments: same as for the detection" << std::endl;
+        cout << "  reports recall and speed of the tree cascade on the test images and the settings for the recall cascadeRecall" << endl;
+        cout << endl << endl;
+
+        cout << "Training benchmark "<<endl;
+        cout << "  mode = 5; " << std::endl;
+        cout << "  times the split measures of the training on the training pixels" << endl;
+        cout << "  and checks them against the reference measures, returns 1 if they do not match" << endl;
         cout << endl << endl << endl ;
     } else {
 
@@ -968,7 +1552,16 @@ int main( int argc, char* argv[ ] ) {
             run_train( param );
             break;
 
+        case 5: // training benchmark
+
+            param.scale_tree = 1.0f;
+            if( !benchmarkTraining( param ) )
+                return 1;
+            break;
+
         case 1: // detection
+        case 3: // benchmark
+        case 4: // cascade calibration
 
             cout << "running the detection" << endl;
             param.test_num = -1;
@@ -997,7 +1590,7 @@ int main( int argc, char* argv[ ] ) {
             if ( argc > 8 )
                 param.select_test_set = atoi( argv[ 8 ] );
 
-            run_detect(param);
+            run_detect(param, mode);
             break;
 
         default:
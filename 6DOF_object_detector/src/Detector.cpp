@@ -20,11 +20,21 @@ using namespace std;
 
 int COUNT;
 
+// sum over the window [minX,maxX) x [minY,maxY) from an integral image of type CV_64F
+static inline double windowSum( const cv::Mat& integral, int minX, int minY, int maxX, int maxY ) {
+
+    if( maxX <= minX || maxY <= minY )
+        return 0.0;
+
+    return integral.at< double >( maxY, maxX ) - integral.at< double >( minY, maxX ) - integral.at< double >( maxY, minX ) + integral.at< double >( minY, minX );
+}
+
 
 // **********************************    LEAF ASSIGNMENT      ***************************************************** //
 
-// matching the image to the forest and store the leaf assignments in vImgAssing
-void CRForestDetector::assignCluster(const cv::Mat &img, const cv::Mat &depthImg, vector<cv::Mat> &vImgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals) {
+// matching the image to the trees firstTree ... lastTree-1 and store the leaf assignments in imgAssign
+// if active is given (CV_8UC1) only its nonzero pixels are matched
+void CRForestDetector::assignCluster(const cv::Mat &img, const cv::Mat &depthImg, cv::Mat &imgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, int firstTree, int lastTree, const cv::Mat& active) {
 
     cv::Point pt;
     time_t t = time(NULL);
@@ -46,6 +56,9 @@ void CRForestDetector::assignCluster(const cv::Mat &img, const cv::Mat &depthImg
             if (sample_points > 0 && value < sample_points)//  this "if" statement is always true, because sample_points = -1
                 do_regression = false;
 
+            if (!active.empty() && active.at<uchar>(y, x) == 0)
+                do_regression = false;
+
             // for each pixel as a upperleft corner regression is done for the patch of size width x height
             if (do_regression) {
 
@@ -57,10 +70,11 @@ void CRForestDetector::assignCluster(const cv::Mat &img, const cv::Mat &depthImg
                     scale = 1000.f/(float)depthImg.at<unsigned short>(pt); // convert from millimeter to meter
 
 
-                crForest->regression( result, vImg, normals, pt, scale );// result has Leafnodes form all the trees matching with img
+                crForest->regression( result, firstTree, lastTree, vImg, normals, pt, scale );// result has Leafnodes form all the trees matching with img
                 // and id of leaf is saved for each tree
+                int* leafs = imgAssign.ptr<int>(y) + x * imgAssign.channels() + firstTree;
                 for (unsigned int treeNr=0; treeNr < result.size(); treeNr++) {
-                    vImgAssign[treeNr].at<float>(pt) = float(result[treeNr]);
+                    leafs[treeNr] = result[treeNr];
                 }
             }
         } // end for x
@@ -68,92 +82,190 @@ void CRForestDetector::assignCluster(const cv::Mat &img, const cv::Mat &depthImg
 
 }
 
-// Multi-scale cluster assignment into vvImgAssign.
-void CRForestDetector::fullAssignCluster(const cv::Mat &img, const cv::Mat &depthImg, vector< cv::Mat > &vImgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals) {
+// Multi-scale cluster assignment into imgAssign, the leaf ids of all trees for one pixel are stored next to each other
+void CRForestDetector::fullAssignCluster(const cv::Mat &img, const cv::Mat &depthImg, cv::Mat &imgAssign, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, int cascadeTrees, float cascadeThreshold, const cv::Mat &gate) {
 
     int ntrees = crForest->vTrees.size();
-    cv::Scalar s(-1.0);
 
-    vImgAssign.resize(ntrees);
+    // image is initialized with -1 , which indicates not matched regions
+    imgAssign.create(img.rows, img.cols, CV_32SC(ntrees));
+    imgAssign.reshape(1).setTo(cv::Scalar(-1));
 
-    //looping over the trees in the forest
-    for (int treeNr=0; treeNr < ntrees; treeNr++)// for each tree
-        vImgAssign[treeNr] =cv::Mat(img.rows,img.cols, CV_32FC1, s); // image is initialized with -1 , which indicates not matched regions
+    if (cascadeTrees <= 0 || cascadeTrees >= ntrees) {
+        // matching the img to the forest and store the leaf assignments in imgAssign
+        assignCluster(img, depthImg, imgAssign, vImg , normals, 0, ntrees, gate);
+        return;
+    }
 
-    // matching the img to the forest and store the leaf assignments in vImgAssing
-    assignCluster(img, depthImg, vImgAssign, vImg , normals);
+    // cascade: the first trees are evaluated everywhere, the other trees only where the object is likely
+    assignCluster(img, depthImg, imgAssign, vImg , normals, 0, cascadeTrees, gate);
+
+    cv::Mat estimate;
+    foregroundEstimate(imgAssign, cascadeTrees, estimate);
+    cv::Mat active = estimate >= cascadeThreshold;
+    if (!gate.empty())
+        active &= gate;
+
+    // rejected pixels are unassigned, they neither count for the class confidence nor vote
+    int nActive = 0;
+    for (int y=0; y < imgAssign.rows; y++) {
+        int* leafs = imgAssign.ptr<int>(y);
+        const uchar* act = active.ptr<uchar>(y);
+        for (int x=0; x < imgAssign.cols; x++, leafs += ntrees) {
+            if (act[x]) {
+                nActive++;
+                continue;
+            }
+            for (int treeNr=0; treeNr < cascadeTrees; treeNr++)
+                leafs[treeNr] = -1;
+        }
+    }
 
+    assignCluster(img, depthImg, imgAssign, vImg , normals, cascadeTrees, ntrees, active);
+
+    cout << "\t cascade passed " << 100.f * nActive / float(imgAssign.rows * imgAssign.cols) << "% of the pixels" << endl;
+}
+
+// A pixel can only support a center within its distance to the center, at most the half diagonal of the largest bounding
+// box. The centers of the scales have a depth in ( a/(nScales+1), a ] with a = nScales/(scales.back() - scales.front()).
+// Pixels without depth stay in the gate, they are matched and add to the class confidences as without gate
+void CRForestDetector::depthGate(const cv::Mat &depthImg, const std::vector<float>& scales, const std::vector<cv::Point3f>& vbbSize, cv::Mat &gate) {
+
+    float radius = 0.f;
+    for (unsigned int cNr=0; cNr < vbbSize.size(); cNr++)
+        radius = std::max(radius, 0.5f * std::sqrt(vbbSize[cNr].x * vbbSize[cNr].x + vbbSize[cNr].y * vbbSize[cNr].y + vbbSize[cNr].z * vbbSize[cNr].z));
+
+    float a = scales.size() / (scales.back() - scales.front());
+
+    // depth range in millimeter
+    float minDepth = 1000.f * (a / (scales.size() + 1) - radius);
+    float maxDepth = 1000.f * (a + radius);
+
+    gate = cv::Mat::zeros(depthImg.rows, depthImg.cols, CV_8UC1);
+    for (int y=0; y < depthImg.rows; y++) {
+        const unsigned short* depth = depthImg.ptr<unsigned short>(y);
+        uchar* g = gate.ptr<uchar>(y);
+        for (int x=0; x < depthImg.cols; x++)
+            if (depth[x] == 0 || (depth[x] >= minDepth && depth[x] <= maxDepth))
+                g[x] = 255;
+    }
+}
+
+// the last label is the background
+void CRForestDetector::foregroundEstimate(const cv::Mat &imgAssign, int nTrees, cv::Mat &estimate) {
+
+    int ntrees = imgAssign.channels();
+    int nlabels = crForest->GetNumLabels();
+    int bgLabel = nlabels - 1;
+
+    // leafProbabilities is normalized by all trees of the forest
+    float norm = float(ntrees) / float(nTrees);
+
+    estimate = cv::Mat::zeros(imgAssign.rows, imgAssign.cols, CV_32FC1);
+
+    for (int y=0; y < imgAssign.rows; y++) {
+        const int* leafs = imgAssign.ptr<int>(y);
+        float* est = estimate.ptr<float>(y);
+        for (int x=0; x < imgAssign.cols; x++, leafs += ntrees) {
+
+            if (leafs[0] < 0)
+                continue;
+
+            float background = 0.f;
+            for (int trNr=0; trNr < nTrees; trNr++)
+                background += leafProbabilities[trNr][leafs[trNr] * nlabels + bgLabel];
+
+            est[x] = 1.f - background * norm;
+        }
+    }
+}
+
+// per tree view of the leaf assignments as CV_32FC1 images, e.g. for debugging
+void CRForestDetector::splitAssignment(const cv::Mat &imgAssign, std::vector< cv::Mat > &vImgAssign) {
+
+    std::vector< cv::Mat > channels;
+    cv::split(imgAssign, channels);
+
+    vImgAssign.resize(channels.size());
+    for (unsigned int treeNr=0; treeNr < channels.size(); treeNr++)
+        channels[treeNr].convertTo(vImgAssign[treeNr], CV_32F);
 }
 
 // ************************************** CLASS CONFIDENCES ****************************************** //
 
-// Getting the per class confidences TODO: this has to become scalable
-void CRForestDetector::getClassConfidence(const std::vector<cv::Mat> &vImgAssign, std::vector<cv::Mat> &classConfidence) {
+// Tables of the class probabilities of all leafs, already divided by the number of trees
+void CRForestDetector::buildLeafProbabilities() {
+
+    int ntrees = crForest->vTrees.size();
+    int nlabels = crForest->GetNumLabels();
+    float inv_tree = 1.0f/float(ntrees);
+
+    leafProbabilities.resize(ntrees);
+    for (int trNr=0; trNr < ntrees; trNr++) {
+
+        int nleafs = crForest->vTrees[trNr]->getNumLeaf();
+        leafProbabilities[trNr].assign(nleafs * nlabels, 0.f);
+
+        for (int leafNr=0; leafNr < nleafs; leafNr++) {
+            LeafNode* leaf = crForest->getLeaf(trNr, leafNr);
+            for (int cNr=0; cNr < nlabels && cNr < int(leaf->vPrLabel.size()); cNr++)
+                leafProbabilities[trNr][leafNr * nlabels + cNr] = leaf->vPrLabel[cNr]*inv_tree;
+        }
+    }
+}
+
+// Getting the per class confidences
+void CRForestDetector::getClassConfidence(const cv::Mat &imgAssign, std::vector<cv::Mat> &classConfidence) {
 
     int nlabels = crForest->GetNumLabels();
     classConfidence.resize(nlabels);
 
     for ( int i=0; i < nlabels; i++)
-        classConfidence[i] = cv::Mat::zeros( vImgAssign[0].rows,vImgAssign[0].cols, CV_32FC1);
+        classConfidence[i] = cv::Mat::zeros( imgAssign.rows,imgAssign.cols, CV_32FC1);
 
-    float ntrees = float(vImgAssign.size());
+    int ntrees = imgAssign.channels();
 
     // function variables
     int outer_window = 8; // TODO: this parameter shall move to the inputs.
-    float inv_tree = 1.0f/ntrees;
-
-    // looping over trees
-    std::vector<std::vector<cv::Mat > >tmpClassProbs(ntrees);
-    for (unsigned int trNr=0; trNr < ntrees; trNr++) {
 
-        tmpClassProbs[trNr].resize(nlabels);
-        // here make a temporary structure of all the probabilities and then smooth it with a kernel.
-        for (int cNr=0; cNr < nlabels; cNr++) {
-            tmpClassProbs[trNr][cNr] = cv::Mat::zeros( vImgAssign[trNr].rows,vImgAssign[trNr].cols, CV_32FC1);
+    // accumulate the probabilities of all trees and classes in one pass, the blurring is linear so it is done once on the sum
+#pragma omp parallel for
+    for ( int y = 0; y < imgAssign.rows ; y++) {
 
-            for ( int y = 0; y < vImgAssign[trNr].rows ; y++) {
-                for ( int x=0; x < vImgAssign[trNr].cols; x++) {
-                    int leaf_id = vImgAssign[trNr].at<float>(y,x);
-                    LeafNode* tmp = crForest->vTrees[trNr]->getLeaf(leaf_id);
+        std::vector< float* > confLine(nlabels);
+        for (int cNr=0; cNr < nlabels; cNr++)
+            confLine[cNr] = classConfidence[cNr].ptr<float>(y);
 
-                    if ( leaf_id >= 0 ) {
-                        tmpClassProbs[trNr][cNr].at<float>(y,x) = tmp->vPrLabel[cNr]*inv_tree;
+        const int* leafs = imgAssign.ptr<int>(y);
 
-                    }
+        for ( int x=0; x < imgAssign.cols; x++, leafs += ntrees) {
+            for (int trNr=0; trNr < ntrees; trNr++) {
+                int leaf_id = leafs[trNr];
+                if ( leaf_id >= 0 ) {
+                    const float* prob = &leafProbabilities[trNr][leaf_id * nlabels];
+                    for (int cNr=0; cNr < nlabels; cNr++)
+                        confLine[cNr][x] += prob[cNr];
                 }
             }
         }
+    }
 
+    for (int cNr=0; cNr < nlabels; cNr++) {
+        // now values of the classConfidence are set we can blur it to get the average
+        cv::GaussianBlur(classConfidence[cNr], classConfidence[cNr], cv::Size(outer_window+1, outer_window+1), 0);
 
+        if(0) {
+            double min, max;
+            cv::Mat tmp;
+            cv::Point max_loc, min_loc;
+            cv::minMaxLoc(classConfidence[cNr], &min, &max, &max_loc, &min_loc, cv::Mat());
+            cv::convertScaleAbs(classConfidence[cNr],tmp,255/max);
+            // shows hough votes for center.
+            cv::imshow("prob",tmp);
+            cv::waitKey(0);
 
-        for (int cNr=0; cNr < nlabels; cNr++) {
-            //SMOOTHING AND SCALING IF NECESSARY
-            double scaleFactor = 1.0;
-            if ( sample_points >= 0 ) {
-                scaleFactor = 1.0/(1.0-sample_points);
-            }
-            // now values of the tmpClassProbs are set we can blur it to get the average
-            cv::GaussianBlur(tmpClassProbs[trNr][cNr], tmpClassProbs[trNr][cNr], cv::Size(outer_window+1, outer_window+1), 0);
-            //cv::convertScaleAbs(tmpClassProbs[trNr][cNr], tmpClassProbs[trNr][cNr], scaleFactor);// to account for the sub-sampling // why scaling ??
-
-            // add confidence of all the trees
-            cv::add(classConfidence[cNr], tmpClassProbs[trNr][cNr], classConfidence[cNr]);
-
-            if(0) {
-                //cv::imshow("prob", tmpClassProbs[trNr][cNr]);
-                //				cv::imshow("prob", classConfidence[cNr]); cv::waitKey(0);
-                double min, max;
-                cv::Mat tmp;
-                cv::Point max_loc, min_loc;
-                cv::minMaxLoc(classConfidence[cNr], &min, &max, &max_loc, &min_loc, cv::Mat());
-                cv::convertScaleAbs(classConfidence[cNr],tmp,255/max);
-                // shows hough votes for center.
-                cv::imshow("prob",tmp);
-                cv::waitKey(0);
-
-            }
         }
-    }// end loop over tree
+    }
 }
 
 /********************************** FULL object detection ************************************/
@@ -531,54 +643,69 @@ void CRForestDetector::detectPosePeaks_slerp(std::vector<Eigen::Quaterniond>& qM
 
 }
 
-void CRForestDetector::detectMaxima(const vector< vector< cv::Mat > >& poseHoughSpace, Eigen::Quaterniond& finalOC, int& step, float& score) {
+void CRForestDetector::detectMaxima(const PoseHoughSpace& poseHoughSpace, Eigen::Quaterniond& finalOC, float& score, bool smooth) {
+
+    int step = poseHoughSpace.steps;
 
-    // smoothing of the houghspace with gaussian kernel
+    // smoothing of the houghspace with gaussian kernel, only evaluated at the bins which received votes
     float sigma = 1.f;
-    int kSize = 5;
+    int kSize = 3;
     cv::Mat gauss = cv::getGaussianKernel( kSize , sigma, CV_32F);
 
-    vector<vector<cv::Mat> > poseHoughSpace_smoothed(poseHoughSpace.size());
-
-    //    // smoothing in qx qy dimensions
-    //    for(int i = 0; i < step; i++){ // qw
-    //        poseHoughSpace_smoothed[i].resize(poseHoughSpace[i].size());
-
-    //        for (int j = 0; j < step; j++){ // qz
-    //            cv::GaussianBlur(poseHoughSpace[i][j], poseHoughSpace_smoothed[i][j], cv::Size(kSize, kSize), sigma);
-
-    //        }
-    //    }
-
+    // bin offsets of the 3x3x3x3 neighborhood and their weights
+    std::vector< int > nOffsets;
+    std::vector< float > nWeights;
+    if( smooth ) {
+        for( int dw = -1; dw <= 1; dw++ )
+            for( int dz = -1; dz <= 1; dz++ )
+                for( int dy = -1; dy <= 1; dy++ )
+                    for( int dx = -1; dx <= 1; dx++ ) {
+                        nOffsets.push_back( ( ( dw * step + dz ) * step + dy ) * step + dx );
+                        nWeights.push_back( gauss.at<float>( dw + 1 ) * gauss.at<float>( dz + 1 ) * gauss.at<float>( dy + 1 ) * gauss.at<float>( dx + 1 ) );
+                    }
+    }
 
+    // find the maximum, ties are resolved to the bin with smallest (qz, qw, qy, qx) as the dense search did
     score = 0;
-    cv::Mat maximaInXY = cv::Mat::zeros(step, step, CV_32FC1);
-    cv::Mat locationInX = cv::Mat::zeros(step, step, CV_32FC1);
-    cv::Mat locationInY = cv::Mat::zeros(step, step, CV_32FC1);
-
-    for(int i = 0; i < step; i++) { // qw
-        for (int j = 0; j < step; j++) { // qz
-            double maxVal, minVal;
-            cv::Point maxIdx, minIdx;
-            cv::minMaxLoc(poseHoughSpace[i][j], &minVal, &maxVal, &minIdx, &maxIdx);
-            maximaInXY.at<float>(j,i) = maxVal;
-            locationInX.at<float> (j,i) = maxIdx.x;
-            locationInY.at<float> (j,i) = maxIdx.y;
+    int maxBin = 0;
+    int maxOrder = 0;
+    int step2 = step * step;
+    int step3 = step2 * step;
+
+    for( boost::unordered_map< int, float >::const_iterator it = poseHoughSpace.bins.begin(); it != poseHoughSpace.bins.end(); ++it ) {
+
+        int bin = it->first;
+        float val = it->second;
+
+        if( smooth ) {
+            int bx = bin % step, by = ( bin / step ) % step, bz = ( bin / step2 ) % step, bw = bin / step3;
+            val = 0.f;
+            int n = 0;
+            for( int dw = -1; dw <= 1; dw++ )
+                for( int dz = -1; dz <= 1; dz++ )
+                    for( int dy = -1; dy <= 1; dy++ )
+                        for( int dx = -1; dx <= 1; dx++, n++ ) {
+                            if( bw + dw < 0 || bw + dw >= step || bz + dz < 0 || bz + dz >= step || by + dy < 0 || by + dy >= step || bx + dx < 0 || bx + dx >= step )
+                                continue;
+                            boost::unordered_map< int, float >::const_iterator nb = poseHoughSpace.bins.find( bin + nOffsets[ n ] );
+                            if( nb != poseHoughSpace.bins.end() )
+                                val += nWeights[ n ] * nb->second;
+                        }
+        }
 
+        // position of the bin in (qz, qw, qy, qx) order
+        int order = ( ( bin / step2 ) % step ) * step3 + ( bin / step3 ) * step2 + bin % step2;
+        if( val > score || ( val == score && val > 0 && order < maxOrder ) ) {
+            score = val;
+            maxBin = bin;
+            maxOrder = order;
         }
     }
 
-    double maxVal, minVal;
-    cv::Point maxIdx, minIdx;
-    cv::minMaxLoc(maximaInXY, &minVal, &maxVal, &minIdx, &maxIdx);
-
-    score = maxVal;
-
-    float dqw = maxIdx.x;
-    float dqz = maxIdx.y;
-
-    float dqy = locationInY.at<float>(maxIdx);
-    float dqx = locationInX.at<float>(maxIdx);
+    float dqx = maxBin % step;
+    float dqy = ( maxBin / step ) % step;
+    float dqz = ( maxBin / step2 ) % step;
+    float dqw = maxBin / step3;
 
     float qx = (dqx + 1.f) * 2.f/(float)step - 1.f;
     float qy = (dqy + 1.f) * 2.f/(float)step - 1.f;
@@ -709,30 +836,64 @@ void CRForestDetector::axisOfSymmetry(std::vector<Eigen::Quaterniond> &qMean, Ei
 
 
 
-void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,const std::vector< std::vector< std::vector< std::vector<std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<cv::Mat>& vImgAssign, const std::vector<std::vector<cv::Mat> >& vImgDetect, std::vector<Candidate>& candidates, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const int kernel_width, const std::vector<float>&scales, const float thresh, const bool DEBUG, const bool addPoseScore) {
+void CRForestDetector::centerPose(Candidate& candidate, const cv::Point2f& img_center) {
+
+    cv::Point3f center_real = CRPixel::P3toR3( candidate.center, img_center, 1/candidate.scale );
+    candidate.coordinateSystem = Eigen::Matrix4d::Identity();
+    candidate.coordinateSystem.block<3,1>(0,3) = Eigen::Vector3d( center_real.x, center_real.y, center_real.z );
+}
+
+void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,const std::vector< std::vector< std::vector< std::vector<std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const cv::Mat& imgAssign, const std::vector<std::vector<cv::Mat> >& vImgDetect, std::vector<Candidate>& candidates, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const int kernel_width, const std::vector<float>&scales, const QueryFrames& frames, const float thresh, const bool DEBUG, const bool addPoseScore, const bool smoothPoseSpace) {
 
     if(candidates.size() > 0) {
 
         std::vector< Eigen::Matrix4d, Eigen::aligned_allocator< Eigen::Matrix4d> > candPoses;
         candPoses.reserve(candidates.size());
-        int nTrees = vImgAssign.size();
+        int nTrees = imgAssign.channels();
 
-        for ( unsigned int cand = 0; cand < candidates.size(); cand++ ) { // loop on candidates we will take for now only the first candidate
+        // candidates below the threshold are rejected before any work is done for them
+        std::vector< int > activeCandidates;
+        for ( unsigned int cand = 0; cand < candidates.size(); cand++ )
+            if( candidates[cand].weight >= thresh )
+                activeCandidates.push_back( cand );
 
-            if(candidates[cand].weight < thresh)
-                continue;
+        int nPixels = frames.width * frames.height;
+        int steps = 50;
+
+        // candidates reached after the deadline keep the pose of their center
+        int skipped = 0;
 
-            int steps = 50, subsample_count = 0;
+        // the candidates are independent, each thread has its own accumulator and cache
+#pragma omp parallel
+        {
+        // local coordinate system of a query pixel only depends on the candidate center, it is computed once per candidate and pixel
+        std::vector< Eigen::Quaterniond, Eigen::aligned_allocator< Eigen::Quaterniond > > qCache;
+        std::vector< int > qStamp;
+
+        // only the occupied bins of the 4D accumulator are stored
+        PoseHoughSpace poseHoughSpace(steps);
+
+#pragma omp for schedule(dynamic)
+        for ( int activeNr = 0; activeNr < int(activeCandidates.size()); activeNr++ ) { // loop on candidates
+
+            int cand = activeCandidates[ activeNr ];
             int cNr = candidates[cand].c;
 
-            std::vector <Eigen::Quaterniond> qMean;
-            std::vector <std::vector <cv::Mat> >poseHoughSpace(steps);
-            for(int i = 0; i<steps; i++) {
-                poseHoughSpace[i].resize(steps);
-                for(int j = 0; j<steps ; j++)
-                    poseHoughSpace[i][j] = cv::Mat::zeros(steps, steps, CV_32FC1);
+            if ( deadlinePassed() ) {
+                centerPose( candidates[ cand ], cv::Point2f( vImg[ 0 ].cols/2.f, vImg[ 0 ].rows/2.f ) );
+#pragma omp atomic
+                skipped++;
+                continue;
             }
 
+            if( qStamp.empty() ) {
+                qCache.resize( nPixels );
+                qStamp.assign( nPixels, -1 );
+            }
+            poseHoughSpace.clear();
+
+            std::vector <Eigen::Quaterniond> qMean;
+
             int x = candidates[ cand ].center.x;
             int y = candidates[ cand ].center.y;
             int scale_number = candidates[ cand ].scale * scales.size()/(scales[scales.size() - 1 ]- scales[ 0 ] ) - 1 ;
@@ -744,6 +905,7 @@ void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,con
 
             cv::Point2f oCenter( x, y );
             cv::Point3f oCenter_real = CRPixel::P3toR3( oCenter, img_center, 1/candidates[ cand ].scale );
+            Eigen::Vector3f oCenter_vec( oCenter_real.x, oCenter_real.y, oCenter_real.z );
 
             for(int scNr = min_s; scNr < max_s; scNr++ ) { //scales
 
@@ -758,33 +920,30 @@ void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,con
 
                         float weight_ = vImgDetect[cNr][scNr].at< float >(y,x) / nTrees;
 
-                        for ( unsigned int trNr = 0; trNr < vImgAssign.size(); trNr ++ ) { // loop for all the trees
+                        for ( int trNr = 0; trNr < nTrees; trNr ++ ) { // loop for all the trees
                             unsigned int total_votes = voterImages[ trNr ][scNr][ cy  ][ cx ].size();
 
                             for ( unsigned int pVotes = 0; pVotes < total_votes; pVotes++ ) { // loop for all the training pixels voted for the center
 
-                                cv::Point2f qPixel = voterImages[ trNr ][ scNr ][ cy  ][ cx ][ pVotes ].first;
-                                cv::Point3f qReal = CRPixel::P3toR3(qPixel, img_center, depthImg.at<int16_t>(qPixel)/1000.f);
-                                int index = voterImages[ trNr ][ scNr ][ cy  ][ cx ][ pVotes ].second;
-                                int leafID = vImgAssign[trNr].at< float >(qPixel);
-                                LeafNode* L = crForest->getLeaf( trNr, leafID );// getLeaf(index);
-
-                                pcl::Normal q_n = normals->at(qPixel.x, qPixel.y);
+                                const cv::Point& qPixel = voterImages[ trNr ][ scNr ][ cy  ][ cx ][ pVotes ].first;
+                                int qIdx = qPixel.y * frames.width + qPixel.x;
 
-                                if(q_n.normal_x != q_n.normal_x)
+                                if( !frames.valid[ qIdx ] )
                                     continue;
 
-                                // compute local coordinate at qPixel
-                                Eigen::Matrix3d T_qC = CRPixel::calcQueryPoint2CameraTransformation(qReal, oCenter_real, q_n);
+                                int index = voterImages[ trNr ][ scNr ][ cy  ][ cx ][ pVotes ].second;
+                                int leafID = imgAssign.ptr< int >(qPixel.y)[qPixel.x * nTrees + trNr];
+                                LeafNode* L = crForest->getLeaf( trNr, leafID );// getLeaf(index);
 
-                                Eigen::Quaterniond T_oC = Eigen::Quaterniond(T_qC) * L->vOrientation[cNr][index];
+                                // compute local coordinate at qPixel
+                                if( qStamp[ qIdx ] != cand ) {
+                                    qCache[ qIdx ] = Eigen::Quaterniond( CRPixel::calcQueryPoint2CameraTransformation( frames, qIdx, oCenter_vec ) );
+                                    qStamp[ qIdx ] = cand;
+                                }
 
-                                int qx = int( ( ( T_oC.x() + 1.0 ) / 2.0 ) * (steps - 1 ) );
-                                int qy = int( ( ( T_oC.y() + 1.0 ) / 2.0 ) * (steps - 1 ) );
-                                int qz = int( ( ( T_oC.z() + 1.0 ) / 2.0 ) * (steps - 1 ) );
-                                int qw = int( ( ( T_oC.w() + 1.0 ) / 2.0 ) * (steps - 1 ) );
+                                Eigen::Quaterniond T_oC = qCache[ qIdx ] * L->vOrientation[cNr][index];
 
-                                poseHoughSpace[ qw ][ qz ].at< float >( qy, qx ) += weight_ / total_votes;
+                                poseHoughSpace.vote( T_oC, weight_ / total_votes );
 
 
                             }//end of votes voted for object center
@@ -802,7 +961,7 @@ void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,con
             Eigen::Quaterniond qfinalOC;
 
             float poseScore;
-            detectMaxima(poseHoughSpace, qfinalOC, steps, poseScore);
+            detectMaxima(poseHoughSpace, qfinalOC, poseScore, smoothPoseSpace);
             Eigen::Matrix3d finalOC(qfinalOC);
 
             candidates[cand].weight = poseScore;
@@ -818,11 +977,16 @@ void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,con
             tempOC.block<3,3>(0,0) = finalOC;
             tempOC.block<3,1>(0,3) = Eigen::Vector3d(oCenter_real.x, oCenter_real.y, oCenter_real.z);
 
-            candPoses.push_back(tempOC) ;
-
             candidates[cand].coordinateSystem = tempOC;
 
         }// end of candidates
+        }
+
+        if ( skipped > 0 )
+            cout << "\t deadline reached, pose estimation skipped for " << skipped << " of " << activeCandidates.size() << " candidates" << endl;
+
+        for ( unsigned int activeNr = 0; activeNr < activeCandidates.size(); activeNr++ )
+            candPoses.push_back( candidates[ activeCandidates[ activeNr ] ].coordinateSystem );
 
         if( DEBUG ) {
 
@@ -854,7 +1018,7 @@ void CRForestDetector::voteForPose(const cv::Mat img, const cv::Mat depthImg,con
 }
 
 
-void CRForestDetector::detectCenterPeaks(std::vector<Candidate >& candidates, const std::vector<std::vector<cv::Mat> >& imgDetect, const std::vector<cv::Mat>& vImgAssign, const std::vector< std::vector< std::vector< std::vector<std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const  cv::Mat& depthImg, const cv::Mat& img, const Parameters& param, int this_class) {
+void CRForestDetector::detectCenterPeaks(std::vector<Candidate >& candidates, const std::vector<std::vector<cv::Mat> >& imgDetect, const cv::Mat& imgAssign, const std::vector< std::vector< std::vector< std::vector<std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const  cv::Mat& depthImg, const cv::Mat& img, const Parameters& param, int this_class, int minVotes) {
 
     candidates.clear();
 
@@ -936,98 +1100,141 @@ void CRForestDetector::detectCenterPeaks(std::vector<Candidate >& candidates, co
             }
 
 
-        // each candidate is a six element vector weight, x, y, scale, class, ratio
-        int candNr = 0;
-        bool goodCandidate;
+        // collect the local maxima above the threshold once, strongest first
+        std::vector< HoughPeak > peaks;
+        for( unsigned int scNr = 0; scNr < nScales; scNr++ ) {
+            for( int y = 0; y < localMax[ scNr ].rows; y++ ) {
+                const float* line = localMax[ scNr ].ptr< float >( y );
+                for( int x = 0; x < localMax[ scNr ].cols; x++ ) {
+                    if( line[ x ] >= param.thresh_detection ) {
+                        HoughPeak peak;
+                        peak.val = line[ x ];
+                        peak.scale = scNr;
+                        peak.x = x;
+                        peak.y = y;
+                        peaks.push_back( peak );
+                    }
+                }
+            }
+        }
+        std::sort( peaks.begin(), peaks.end() );
 
-        for ( int count = 0; count < param.max_candidates; count++ ) { // count can go until infinity
+        // regions removed around the already taken candidates, peaks falling inside them are skipped when reached
+        std::vector< std::vector< cv::Rect > > suppressed( nScales );
 
-            bool flag = false;
-            std::vector< cv::Point > max_loc_temp( nScales );
-            std::vector< double > max_val_temp( nScales );
+        // integral images of the hough slices (weight, x * weight, y * weight) and of the number of votes of all trees for the refinement
+        std::vector< cv::Mat > intWeight( nScales ), intWeightX( nScales ), intWeightY( nScales ), intVotes( nScales );
+        if( !peaks.empty() ) {
 
-            Candidate max_position;// weight, x, y, scNr, cNr, rNr, bb.x, bb.y, bb.z
-            goodCandidate = 1;
+            int rows = imgDetect[ cNr ][ 0 ].rows;
+            int cols = imgDetect[ cNr ][ 0 ].cols;
 
+            cv::Mat rampX( rows, cols, CV_32FC1 ), rampY( rows, cols, CV_32FC1 );
+            for( int y = 0; y < rows; y++ ) {
+                float* lineX = rampX.ptr< float >( y );
+                float* lineY = rampY.ptr< float >( y );
+                for( int x = 0; x < cols; x++ ) {
+                    lineX[ x ] = float( x );
+                    lineY[ x ] = float( y );
+                }
+            }
 
-            // detect the maximum
-            for( unsigned int scNr = 0; scNr < nScales; scNr++)
-                cv::minMaxLoc( localMax[scNr], 0, &max_val_temp[scNr], 0, &max_loc_temp[scNr], cv::Mat() );
+            for( unsigned int scNr = 0; scNr < nScales; scNr++ ) {
 
-            std::vector< double >::iterator it;
-            it = std::max_element( max_val_temp.begin(),max_val_temp.end() );
-            int max_index = std::distance( max_val_temp.begin(), it );
+                cv::Mat weighted;
+                cv::integral( imgDetect[ cNr ][ scNr ], intWeight[ scNr ], CV_64F );
+                cv::multiply( imgDetect[ cNr ][ scNr ], rampX, weighted );
+                cv::integral( weighted, intWeightX[ scNr ], CV_64F );
+                cv::multiply( imgDetect[ cNr ][ scNr ], rampY, weighted );
+                cv::integral( weighted, intWeightY[ scNr ], CV_64F );
+
+                cv::Mat votes = cv::Mat::zeros( rows, cols, CV_64FC1 );
+                for( int trNr = 0; trNr < imgAssign.channels(); trNr++ ) {
+                    for( int y = 0; y < rows; y++ ) {
+                        double* line = votes.ptr< double >( y );
+                        for( int x = 0; x < cols; x++ )
+                            line[ x ] += voterImages[ trNr ][ scNr ][ y ][ x ].size();
+                    }
+                }
+                cv::integral( votes, intVotes[ scNr ], CV_64F );
+            }
+        }
 
-            double max_value = max_val_temp[max_index];
-            if ( ( max_value >= param.thresh_detection) && (max_value > max_position.weight) ) {
-                flag = true;
-                max_position.weight = max_value;
+        // each candidate is a six element vector weight, x, y, scale, class, ratio
+        int candNr = 0;
+        bool goodCandidate;
+        unsigned int peakNr = 0;
 
-                localMax[max_index].at<float>(max_loc_temp[max_index].y, max_loc_temp[max_index].x) = 0.f;
+        for ( int count = 0; count < param.max_candidates; count++ ) { // count can go until infinity
 
-                // take average to get the sub depth accuracy
-                int spatialRadius = param.kernel_width[0];
-                int scaleRadius = 1;
-                float score_sum = 0;
-                int num_votes = 0;
-                float avgScale = 0, avgWeight = 0, avgX = 0, avgY = 0;
-                int minS = std::max(0, max_index - scaleRadius);
-                int maxS = std::min(int(param.scales.size()), max_index + scaleRadius);
+            // take the strongest peak which is not suppressed yet
+            bool flag = false;
+            for( ; peakNr < peaks.size() && !flag; peakNr++ ) {
+                flag = true;
+                cv::Point pt( peaks[ peakNr ].x, peaks[ peakNr ].y );
+                const std::vector< cv::Rect >& rects = suppressed[ peaks[ peakNr ].scale ];
+                for( unsigned int rNr = 0; rNr < rects.size() && flag; rNr++ )
+                    flag = !rects[ rNr ].contains( pt );
+            }
 
-                for(unsigned int trNr = 0; trNr < vImgAssign.size(); trNr++) {
+            if (!flag)
+                break;
 
-                    for( int wscale = minS; wscale < maxS; wscale++ ) {
+            const HoughPeak& peak = peaks[ peakNr - 1 ];
+            int max_index = peak.scale;
 
-                        int minX = std::max( 0, int (max_loc_temp[ max_index ].x - spatialRadius * param.scales[wscale]) );
-                        int maxX = std::min( imgDetect[ cNr ][ 0 ].cols, int(max_loc_temp[ max_index ].x + spatialRadius * param.scales[wscale] ));
-                        int minY = std::max( 0, int( max_loc_temp[ max_index ].y - spatialRadius * param.scales[wscale] ));
-                        int maxY = std::min( imgDetect[ cNr ][ 0 ].rows, int(max_loc_temp[ max_index ].y + spatialRadius * param.scales[wscale] ));
+            Candidate max_position;// weight, x, y, scNr, cNr, rNr, bb.x, bb.y, bb.z
+            goodCandidate = 1;
 
-                        for( int wx = minX; wx < maxX ; wx++ ) {
+            max_position.weight = peak.val;
 
-                            for(int wy = minY; wy < maxY ; wy++ ) {
+            // take average to get the sub depth accuracy
+            int spatialRadius = param.kernel_width[0];
+            int scaleRadius = 1;
+            int num_votes = 0;
+            float avgScale = 0, avgWeight = 0, avgX = 0, avgY = 0;
+            int minS = std::max(0, max_index - scaleRadius);
+            int maxS = std::min(int(param.scales.size()), max_index + scaleRadius);
 
-                                score_sum  = score_sum + imgDetect[cNr][ wscale ].at<float>(wy,wx);
+            for( int wscale = minS; wscale < maxS; wscale++ ) {
 
-                                // averaging the scale
-                                avgWeight += imgDetect[cNr][ wscale ].at<float>(wy,wx);
-                                avgScale += param.scales[wscale] * imgDetect[cNr][ wscale ].at<float>(wy,wx) ;
-                                avgX += wx * imgDetect[cNr][ wscale ].at<float>(wy,wx) ;
-                                avgY += wy *imgDetect[cNr][ wscale ].at<float>(wy,wx) ;
+                int minX = std::max( 0, int (peak.x - spatialRadius * param.scales[wscale]) );
+                int maxX = std::min( imgDetect[ cNr ][ 0 ].cols, int(peak.x + spatialRadius * param.scales[wscale] ));
+                int minY = std::max( 0, int( peak.y - spatialRadius * param.scales[wscale] ));
+                int maxY = std::min( imgDetect[ cNr ][ 0 ].rows, int(peak.y + spatialRadius * param.scales[wscale] ));
 
-                                // averaging the bounding box size
-                                unsigned int total_votes = voterImages[ trNr ][ wscale ][ wy ][ wx ].size();
-                                num_votes += total_votes;
+                float weight = windowSum( intWeight[ wscale ], minX, minY, maxX, maxY );
 
-                            }
-                        }
-                    }
-                }
+                // averaging the scale
+                avgWeight += weight;
+                avgScale += param.scales[wscale] * weight;
+                avgX += windowSum( intWeightX[ wscale ], minX, minY, maxX, maxY );
+                avgY += windowSum( intWeightY[ wscale ], minX, minY, maxX, maxY );
 
-                if( avgWeight > 0) {
-                    max_position.center.x = avgX/avgWeight;
-                    max_position.center.y = avgY/avgWeight;
-                    max_position.scale = avgScale/avgWeight;
-                } else {
-                    max_position.center.x = float(max_loc_temp[max_index].x);
-                    max_position.center.y = float(max_loc_temp[max_index].y);
-                    max_position.scale = param.scales[max_index];
-                }
+                // number of votes of all trees supporting the candidate
+                num_votes += int( windowSum( intVotes[ wscale ], minX, minY, maxX, maxY ) + 0.5 );
+            }
 
+            if( avgWeight > 0) {
+                max_position.center.x = avgX/avgWeight;
+                max_position.center.y = avgY/avgWeight;
+                max_position.scale = avgScale/avgWeight;
+            } else {
+                max_position.center.x = float(peak.x);
+                max_position.center.y = float(peak.y);
+                max_position.scale = param.scales[max_index];
+            }
 
-                max_position.c = cNr;
-//                 max_position.r = 0;
 
-//                 max_position.bbSize = param.bbSize;
+            max_position.c = cNr;
+//             max_position.r = 0;
 
-                if(num_votes < 100)
-                    goodCandidate = 0;
-            }
+//             max_position.bbSize = param.bbSize;
 
-            if (!flag)
-                break;
-            else
-                candNr++;
+            if(num_votes < minVotes)
+                goodCandidate = 0;
+
+            candNr++;
 
             // push the candidate in the stack
             if( goodCandidate )
@@ -1056,27 +1263,7 @@ void CRForestDetector::detectCenterPeaks(std::vector<Candidate >& candidates, co
                 if ( max_position.c >= 0 && cNr != max_position.c )
                     continue;
 
-                if( 0 )
-                    cv::imshow( "original", localMax[scNr] );
-
-
-                cv::Mat ROI = localMax[ scNr ](cv::Rect( x, y, rwidth, rheight ) );
-                ROI = cv::Scalar( 0 );
-
-                if( 0 ) {
-
-                    double min, max;
-                    cv::Mat tmp;
-                    cv::Point max_loc, min_loc;
-
-                    cv::minMaxLoc( localMax[scNr], &min, &max, &max_loc, &min_loc, cv::Mat());
-                    cv::convertScaleAbs( localMax[scNr], tmp, 255/max );
-                    cv::Mat kernel = cv::Mat::ones( 10, 10, CV_32FC1 );
-                    cv::dilate( tmp, tmp, kernel );// cv::imshow("dilate", dilatedImg); cv::waitKey(0);
-                    cv::imshow("removed", tmp);
-                    cv::waitKey(0);
-
-                }
+                suppressed[ scNr ].push_back( cv::Rect( x, y, rwidth, rheight ) );
 
             }// for each scale
 
@@ -1087,16 +1274,16 @@ void CRForestDetector::detectCenterPeaks(std::vector<Candidate >& candidates, co
 }
 
 // given the cluster assignment images, we are voting into the voting space vImgDetect
-void CRForestDetector::voteForCenter(const std::vector<cv::Mat>& vImgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const  cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const std::vector<float>& scales, int& this_class, cv::Rect* focus, const float& prob_threshold, const std::vector<cv::Mat>& classProbs, const Parameters& param, bool addPoseInformation,  bool addScaleInformation ) {
+void CRForestDetector::voteForCenter(const cv::Mat& imgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const  cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const std::vector<float>& scales, int& this_class, cv::Rect* focus, const float& prob_threshold, const std::vector<cv::Mat>& classProbs, const Parameters& param, bool addPoseInformation,  bool addScaleInformation ) {
 
 
     // vImgDetect are all initialized before
 
-    if ( vImgAssign.size() < 1)
+    if ( imgAssign.channels() < 1)
         return;
 
 
-    unsigned ntrees = vImgAssign.size();
+    unsigned ntrees = imgAssign.channels();
 
     unsigned int nScales = scales.size();
 
@@ -1110,38 +1297,61 @@ void CRForestDetector::voteForCenter(const std::vector<cv::Mat>& vImgAssign, std
 
         for ( unsigned int scNr = 0; scNr < nScales; scNr++ ) { // for all scale
 
-            voterImages[ trNr ][ scNr ].resize( vImgAssign[ trNr ].rows );
+            voterImages[ trNr ][ scNr ].resize( imgAssign.rows );
 
-            for ( int y = 0 ; y < vImgAssign[ trNr ].rows; y++ ) { // for all pixel y coordinates
+            for ( int y = 0 ; y < imgAssign.rows; y++ ) { // for all pixel y coordinates
 
-                voterImages[ trNr ][ scNr ][ y ].resize( vImgAssign[ trNr ].cols );
+                voterImages[ trNr ][ scNr ][ y ].resize( imgAssign.cols );
 
             }
         }
     }
 
+    // only the budgeted voting measures the part of the forest it used
+    forestUsage = -1.f;
 
-    for ( unsigned int trNr = 0; trNr < ntrees; trNr++ ) {
+    // with a focus only the query pixels inside of it vote, the votes are still in image coordinates
+    cv::Rect roi( 0, 0, imgAssign.cols, imgAssign.rows );
+    if ( focus != NULL )
+        roi &= *focus;
 
-        cv::Point2f imgCenterPixel( vImgAssign[ trNr ].cols/2.f, vImgAssign[ trNr ].rows/2.f );
+    if ( param.voteBudget > 0 || deadline > 0 ) {
+        voteForCenterBudgeted( imgAssign, vImgDetect, depthImg, voterImages, scales, this_class, prob_threshold, classProbs, addScaleInformation, param.voteBudget, roi );
+        return;
+    }
 
-        for ( int y = 0 ; y < vImgAssign[ trNr ].rows; y++ ) {
+    if ( param.leafGroupedVoting ) {
+        voteForCenterByLeaf( imgAssign, vImgDetect, depthImg, voterImages, scales, this_class, prob_threshold, classProbs, addScaleInformation, roi );
+        return;
+    }
 
-            for ( int x = 0; x < vImgAssign[ trNr ].cols; x++ ) {
-                // get the leaf_id
-                if( vImgAssign[ trNr ].at< float >( y, x ) < 0 )
-                    continue;
 
-                cv::Point2f qPixel(x,y);
+    cv::Point2f imgCenterPixel( imgAssign.cols/2.f, imgAssign.rows/2.f );
 
-                float qScale;
-                if( depthImg.at< unsigned short >( y, x ) == 0 )
-                    continue; //qScale = FLT_MAX;
-                else
-                    qScale = 1000.f/(float)depthImg.at< unsigned short >( qPixel );
+    for ( int y = roi.y ; y < roi.y + roi.height; y++ ) {
+
+        const int* leafs = imgAssign.ptr< int >( y ) + roi.x * ntrees;
+
+        for ( int x = roi.x; x < roi.x + roi.width; x++, leafs += ntrees ) {
+
+            cv::Point2f qPixel(x,y);
+
+            float qScale;
+            if( depthImg.at< unsigned short >( y, x ) == 0 )
+                continue; //qScale = FLT_MAX;
+            else
+                qScale = 1000.f/(float)depthImg.at< unsigned short >( qPixel );
+
+            cv::Point3f qPoint = CRPixel::P3toR3(qPixel, imgCenterPixel, 1/qScale);
+
+            // the leafs of all trees for this pixel are stored next to each other
+            for ( unsigned int trNr = 0; trNr < ntrees; trNr++ ) {
+
+                // get the leaf_id
+                if( leafs[ trNr ] < 0 )
+                    continue;
 
-                cv::Point3f qPoint = CRPixel::P3toR3(qPixel, imgCenterPixel, 1/qScale);
-                LeafNode* tmp = crForest->vTrees[ trNr ]->getLeaf(vImgAssign[ trNr ].at<float>(qPixel));
+                LeafNode* tmp = crForest->vTrees[ trNr ]->getLeaf( leafs[ trNr ] );
 
                 for (unsigned int cNr = 0; cNr < vImgDetect.size(); cNr++) {
 
@@ -1182,21 +1392,11 @@ void CRForestDetector::voteForCenter(const std::vector<cv::Mat>& vImgAssign, std
                             if(addScaleInformation)
                                 wScale = 1.f/std::pow(scales[scNr],2);
 
-                            if ( focus==NULL ) {
-                                if( int(objCenterPixel.y) >= 0 && int(objCenterPixel.y) < vImgDetect[ cNr ][ scNr ].rows && int(objCenterPixel.x) >= 0 && int(objCenterPixel.x) < vImgDetect[ cNr ][ scNr ].cols ) {
-                                    vImgDetect[ cNr ][ scNr ].at< float >( int(objCenterPixel.y), int(objCenterPixel.x)) += ( *itW ) * w * wScale;
+                            if( int(objCenterPixel.y) >= 0 && int(objCenterPixel.y) < vImgDetect[ cNr ][ scNr ].rows && int(objCenterPixel.x) >= 0 && int(objCenterPixel.x) < vImgDetect[ cNr ][ scNr ].cols ) {
+                                vImgDetect[ cNr ][ scNr ].at< float >( int(objCenterPixel.y), int(objCenterPixel.x)) += ( *itW ) * w * wScale;
 
-                                    if( count % sample_factor == 0 )
-                                        voterImages[ trNr ][scNr][ int(objCenterPixel.y ) ][ int(objCenterPixel.x ) ].push_back( std::pair< cv::Point, int > (cv::Point( x, y ), voteIndex ));
-                                }
-                            } else {
-                                if ( isInsideRect( focus, x, y) ) {
-
-                                    vImgDetect[ cNr ][ scNr ].at< float >(int(objCenterPixel.y - focus->y) , int( objCenterPixel.x - focus->x )) += ( *itW ) * w * wScale;
-
-                                    if( count % sample_factor == 0 )
-                                        voterImages[ trNr ][scNr][ int(objCenterPixel.y ) ][ int(objCenterPixel.x) ].push_back( std::pair< cv::Point, int > (cv::Point( x, y ), voteIndex ));
-                                }
+                                if( count % sample_factor == 0 )
+                                    voterImages[ trNr ][scNr][ int(objCenterPixel.y ) ][ int(objCenterPixel.x ) ].push_back( std::pair< cv::Point, int > (cv::Point( x, y ), voteIndex ));
                             }
 
                             count++;
@@ -1207,9 +1407,342 @@ void CRForestDetector::voteForCenter(const std::vector<cv::Mat>& vImgAssign, std
             }
         }
     }
+}
+
+// 3D points of all pixels with a depth value
+void CRForestDetector::computeQueryPoints(const cv::Mat& depthImg, std::vector< cv::Point3f >& qPoints, std::vector< uchar >& hasDepth) {
 
+    cv::Point2f imgCenterPixel( depthImg.cols/2.f, depthImg.rows/2.f );
+
+    qPoints.resize( depthImg.rows * depthImg.cols );
+    hasDepth.assign( depthImg.rows * depthImg.cols, 0 );
+
+    for ( int y = 0 ; y < depthImg.rows; y++ ) {
+        for ( int x = 0; x < depthImg.cols; x++ ) {
+
+            if( depthImg.at< unsigned short >( y, x ) == 0 )
+                continue;
+
+            cv::Point2f qPixel(x,y);
+            float qScale = 1000.f/(float)depthImg.at< unsigned short >( qPixel );
+            qPoints[ y * depthImg.cols + x ] = CRPixel::P3toR3(qPixel, imgCenterPixel, 1/qScale);
+            hasDepth[ y * depthImg.cols + x ] = 1;
+        }
+    }
+}
+
+// counting sort of the pixels (with depth) inside of roi by the leaf they reached in tree trNr, the pixels of leaf l are pixels[leafStart[l]] ... pixels[leafStart[l+1]-1]
+void CRForestDetector::groupPixelsByLeaf(const cv::Mat& imgAssign, int trNr, const std::vector< uchar >& hasDepth, const cv::Rect& roi, std::vector< int >& leafStart, std::vector< int >& pixels) {
+
+    int ntrees = imgAssign.channels();
+    int cols = imgAssign.cols;
+    int nleafs = crForest->vTrees[ trNr ]->getNumLeaf();
+    leafStart.assign( nleafs + 1, 0 );
+
+    for ( int y = roi.y ; y < roi.y + roi.height; y++ ) {
+        const int* leafs = imgAssign.ptr< int >( y ) + roi.x * ntrees + trNr;
+        for ( int x = roi.x; x < roi.x + roi.width; x++, leafs += ntrees )
+            if( *leafs >= 0 && hasDepth[ y * cols + x ] )
+                leafStart[ *leafs + 1 ]++;
+    }
+
+    for ( int leafNr = 0; leafNr < nleafs; leafNr++ )
+        leafStart[ leafNr + 1 ] += leafStart[ leafNr ];
+
+    pixels.resize( leafStart[ nleafs ] );
+    std::vector< int > leafFill( leafStart.begin(), leafStart.end() - 1 );
+
+    for ( int y = roi.y ; y < roi.y + roi.height; y++ ) {
+        const int* leafs = imgAssign.ptr< int >( y ) + roi.x * ntrees + trNr;
+        for ( int x = roi.x; x < roi.x + roi.width; x++, leafs += ntrees )
+            if( *leafs >= 0 && hasDepth[ y * cols + x ] )
+                pixels[ leafFill[ *leafs ]++ ] = y * cols + x;
+    }
+}
+
+// pixels of a leaf which vote for class cNr, the same condition as in voteForCenter
+void CRForestDetector::selectVoters(const LeafNode* leaf, int trNr, int cNr, const int* begin, const int* end, int cols, float prob_threshold, const std::vector<cv::Mat>& classProbs, std::vector< int >& voters) {
+
+    voters.clear();
+
+    if ( Class_id[ trNr ][ cNr ] <= 0 )
+        return;
+
+    if (prob_threshold < 0) {
+        if ( leaf->vPrLabel[ cNr ]*Class_id[ trNr ].size() > 1 )
+            voters.assign( begin, end );
+    } else {
+        for ( const int* pixel = begin; pixel != end; pixel++ )
+            if ( classProbs[ cNr ].at<float>( *pixel / cols, *pixel % cols ) > prob_threshold )
+                voters.push_back( *pixel );
+    }
+}
+
+// cast one vote of a leaf for all voters, weight is the weight of the vote without the scale factor.
+// Returns the number of votes which fell into the hough space
+int CRForestDetector::castLeafVote(const cv::Point3f& offset, int voteIndex, float weight, const std::vector< int >& voters, std::vector< int >& count, const std::vector< cv::Point3f >& qPoints, int cols, int trNr, int cNr, std::vector< std::vector<cv::Mat> >& vImgDetect, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<float>& scales, bool addScaleInformation) {
+
+    int sample_factor = 20;
+    float wScale = 1;
+    cv::Point2f imgCenterPixel( vImgDetect[ cNr ][ 0 ].cols/2.f, vImgDetect[ cNr ][ 0 ].rows/2.f );
+    int cast = 0;
+
+    for ( unsigned int vNr = 0; vNr < voters.size(); vNr++ ) {
+
+        cv::Point3f objCenterPoint = qPoints[ voters[ vNr ] ] - offset;
+        cv::Point2f objCenterPixel;
+        float objCenterdepth;
+
+        CRPixel::R3toP3( objCenterPoint, imgCenterPixel, objCenterPixel, objCenterdepth );
+
+        int scNr = int(( scales.size() / ( scales.back() - scales.front() )) / objCenterdepth) - 1;
+        if  ( (scNr < 0) || scNr > int(scales.size() - 1) )
+            continue;
+
+        if(addScaleInformation)
+            wScale = 1.f/std::pow(scales[scNr],2);
+
+        if( int(objCenterPixel.y) >= 0 && int(objCenterPixel.y) < vImgDetect[ cNr ][ scNr ].rows && int(objCenterPixel.x) >= 0 && int(objCenterPixel.x) < vImgDetect[ cNr ][ scNr ].cols ) {
+            vImgDetect[ cNr ][ scNr ].at< float >( int(objCenterPixel.y), int(objCenterPixel.x)) += weight * wScale;
+            cast++;
+
+            if( count[ vNr ] % sample_factor == 0 )
+                voterImages[ trNr ][scNr][ int(objCenterPixel.y ) ][ int(objCenterPixel.x ) ].push_back( std::pair< cv::Point, int > (cv::Point( voters[ vNr ] % cols, voters[ vNr ] / cols ), voteIndex ));
+        }
+
+        count[ vNr ]++;
+    }
+    return cast;
+}
+
+// Same votes as the pixel order loop of voteForCenter, but the query pixels are first grouped by the leaf they reached
+// in each tree, so the votes of a leaf are streamed once over all of its pixels while they stay in the cache.
+// Only the query pixels inside of roi vote.
+void CRForestDetector::voteForCenterByLeaf(const cv::Mat& imgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<float>& scales, int this_class, float prob_threshold, const std::vector<cv::Mat>& classProbs, bool addScaleInformation, const cv::Rect& roi ) {
+
+    unsigned int ntrees = imgAssign.channels();
+    int cols = imgAssign.cols;
+
+    std::vector< cv::Point3f > qPoints;
+    std::vector< uchar > hasDepth;
+    computeQueryPoints( depthImg, qPoints, hasDepth );
+
+    std::vector< int > leafStart, pixels, voters, count;
+
+    for ( unsigned int trNr = 0; trNr < ntrees; trNr++ ) {
+
+        groupPixelsByLeaf( imgAssign, trNr, hasDepth, roi, leafStart, pixels );
+
+        for ( int leafNr = 0; leafNr + 1 < int(leafStart.size()); leafNr++ ) {
+
+            if( leafStart[ leafNr ] == leafStart[ leafNr + 1 ] )
+                continue;
+
+            LeafNode* tmp = crForest->vTrees[ trNr ]->getLeaf( leafNr );
+
+            for (unsigned int cNr = 0; cNr < vImgDetect.size(); cNr++) {
+
+                if ((this_class >= 0 ) && (this_class != (int)cNr)) // the voting should be done on a single class only
+                    continue;
+
+                selectVoters( tmp, trNr, cNr, &pixels[ leafStart[ leafNr ] ], &pixels[ 0 ] + leafStart[ leafNr + 1 ], cols, prob_threshold, classProbs, voters );
+                if ( voters.empty() )
+                    continue;
+
+                float w = tmp->vPrLabel[ cNr ] / ntrees;
+                count.assign( voters.size(), 0 );
+
+                // vote for all points stored in the leaf
+                vector<float>::const_iterator itW = tmp->vCenterWeights[ cNr ].begin();
+                for( vector< cv::Point3f >::const_iterator it = tmp->vCenter[ cNr ].begin() ; it!=tmp->vCenter[ cNr ].end(); ++it, itW++ )
+                    castLeafVote( *it, std::distance( tmp->vCenter[cNr].begin(), it ), ( *itW ) * w, voters, count, qPoints, cols, trNr, cNr, vImgDetect, voterImages, scales, addScaleInformation );
+            }
+        }
+    }
+}
+
+// Anytime voting for the center: the trees are processed one after the other, within a tree the leafs are taken by
+// decreasing purity and their votes are importance sampled by purity times weight, until the vote budget is spent or
+// the deadline is reached. The hough space is normalized by the part of the forest which was used.
+// Only the query pixels inside of roi vote.
+void CRForestDetector::voteForCenterBudgeted(const cv::Mat& imgAssign, std::vector< std::vector<cv::Mat> >& vImgDetect, const cv::Mat& depthImg, std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > >& voterImages, const std::vector<float>& scales, int this_class, float prob_threshold, const std::vector<cv::Mat>& classProbs, bool addScaleInformation, long voteBudget, const cv::Rect& roi ) {
+
+    unsigned int ntrees = imgAssign.channels();
+    int cols = imgAssign.cols;
+
+    std::vector< cv::Point3f > qPoints;
+    std::vector< uchar > hasDepth;
+    computeQueryPoints( depthImg, qPoints, hasDepth );
+
+    // fixed seed, the sampling is reproducible for a frame
+    cv::RNG rng;
+
+    std::vector< int > leafStart, pixels, voters, count;
+    std::vector< VoteGroup > groups;
+
+    double usedTrees = 0;
+    long votesCast = 0;
+    bool outOfBudget = false;
+
+    for ( unsigned int trNr = 0; trNr < ntrees && !outOfBudget; trNr++ ) {
+
+        groupPixelsByLeaf( imgAssign, trNr, hasDepth, roi, leafStart, pixels );
+
+        // all (leaf, class) pairs of this tree with their importance
+        groups.clear();
+        double treeMass = 0, treeVotes = 0;
+        for ( int leafNr = 0; leafNr + 1 < int(leafStart.size()); leafNr++ ) {
+
+            int nPixels = leafStart[ leafNr + 1 ] - leafStart[ leafNr ];
+            if( nPixels == 0 )
+                continue;
+
+            LeafNode* tmp = crForest->vTrees[ trNr ]->getLeaf( leafNr );
+
+            for (unsigned int cNr = 0; cNr < vImgDetect.size(); cNr++) {
+
+                if ((this_class >= 0 ) && (this_class != (int)cNr))
+                    continue;
+
+                if ( Class_id[ trNr ][ cNr ] <= 0 || tmp->vCenter[ cNr ].empty() )
+                    continue;
+
+                float sumWeights = 0;
+                for( unsigned int vNr = 0; vNr < tmp->vCenterWeights[ cNr ].size(); vNr++ )
+                    sumWeights += tmp->vCenterWeights[ cNr ][ vNr ];
+
+                VoteGroup group;
+                group.purity = tmp->vPrLabel[ cNr ];
+                group.leaf = leafNr;
+                group.c = cNr;
+                group.mass = group.purity * sumWeights * nPixels;
+                groups.push_back( group );
+
+                treeMass += group.mass;
+                treeVotes += double( nPixels ) * tmp->vCenter[ cNr ].size();
+            }
+        }
+        std::sort( groups.begin(), groups.end() );
+
+        // a vote is taken with probability proportional to purity * weight such that the tree stays within its share of the budget
+        double target = voteBudget > 0 ? double( voteBudget - votesCast ) / ( ntrees - trNr ) : treeVotes;
+        double sampling = ( target >= treeVotes || treeMass <= 0 ) ? -1.0 : target / treeMass;
+
+        double processedMass = 0;
+        for ( unsigned int gNr = 0; gNr < groups.size(); gNr++ ) {
+
+            if ( deadlinePassed() ) {
+                outOfBudget = true;
+                break;
+            }
+
+            const VoteGroup& group = groups[ gNr ];
+            LeafNode* tmp = crForest->vTrees[ trNr ]->getLeaf( group.leaf );
+
+            selectVoters( tmp, trNr, group.c, &pixels[ leafStart[ group.leaf ] ], &pixels[ 0 ] + leafStart[ group.leaf + 1 ], cols, prob_threshold, classProbs, voters );
+
+            if ( !voters.empty() ) {
+
+                float w = tmp->vPrLabel[ group.c ] / ntrees;
+                count.assign( voters.size(), 0 );
+
+                vector<float>::const_iterator itW = tmp->vCenterWeights[ group.c ].begin();
+                for( vector< cv::Point3f >::const_iterator it = tmp->vCenter[ group.c ].begin() ; it!=tmp->vCenter[ group.c ].end(); ++it, itW++ ) {
+
+                    // the weight of a sampled vote is divided by its probability
+                    float prob = 1.f;
+                    if ( sampling > 0 ) {
+                        prob = std::min( 1.f, float( sampling * group.purity * ( *itW ) ) );
+                        if ( prob <= 0.f || rng.uniform( 0.f, 1.f ) >= prob )
+                            continue;
+                    }
+
+                    // only the votes which fell into the hough space use up the budget
+                    votesCast += castLeafVote( *it, std::distance( tmp->vCenter[group.c].begin(), it ), ( *itW ) * w / prob, voters, count, qPoints, cols, trNr, group.c, vImgDetect, voterImages, scales, addScaleInformation );
+                }
+            }
+
+            processedMass += group.mass;
+        }
+
+        usedTrees += treeMass > 0 ? processedMass / treeMass : 1.0;
+
+        if ( voteBudget > 0 && votesCast >= voteBudget )
+            outOfBudget = true;
+    }
+
+    forestUsage = usedTrees / ntrees;
+
+    // normalize by the trees which were used, so the thresholds keep their meaning
+    if ( usedTrees > 0 && usedTrees < ntrees ) {
+        for ( unsigned int cNr = 0; cNr < vImgDetect.size(); cNr++ )
+            for ( unsigned int scNr = 0; scNr < vImgDetect[ cNr ].size(); scNr++ )
+                vImgDetect[ cNr ][ scNr ] *= ntrees / usedTrees;
+    }
+}
+
+// H = decay * H + (1 - decay) * density * V for the votes V of this frame, which come from 1/density of the pixels.
+// The first frame after a reset initializes H, afterwards vImgDetect is replaced by H
+void CRForestDetector::accumulateTemporalHough(std::vector< std::vector<cv::Mat> >& vImgDetect, int this_class, float decay, float density) {
+
+    if ( temporalHough.size() != vImgDetect.size() )
+        temporalHough.assign( vImgDetect.size(), std::vector< cv::Mat >() );
+
+    for ( unsigned int cNr = 0; cNr < vImgDetect.size(); cNr++ ) {
+
+        if ( (this_class >= 0 ) && (this_class != (int)cNr) )
+            continue;
+
+        std::vector< cv::Mat >& history = temporalHough[ cNr ];
+        bool reset = history.size() != vImgDetect[ cNr ].size();
+
+        if ( reset )
+            history.resize( vImgDetect[ cNr ].size() );
+
+        for ( unsigned int scNr = 0; scNr < vImgDetect[ cNr ].size(); scNr++ ) {
+
+            if ( reset || history[ scNr ].size() != vImgDetect[ cNr ][ scNr ].size() )
+                history[ scNr ] = vImgDetect[ cNr ][ scNr ] * density;
+            else
+                cv::addWeighted( history[ scNr ], decay, vImgDetect[ cNr ][ scNr ], ( 1.f - decay ) * density, 0, history[ scNr ] );
+
+            history[ scNr ].copyTo( vImgDetect[ cNr ][ scNr ] );
+        }
+    }
+}
+
+// the mean absolute depth change of the pixels with depth in both frames, on a grid with step 4
+bool CRForestDetector::cameraMoved(const cv::Mat& depthImg, float threshold) {
+
+    bool moved = false;
+
+    if ( lastDepth.size() == depthImg.size() ) {
+
+        double change = 0;
+        int n = 0;
+        for ( int y = 0; y < depthImg.rows; y += 4 ) {
+            const unsigned short* depth = depthImg.ptr< unsigned short >( y );
+            const unsigned short* last = lastDepth.ptr< unsigned short >( y );
+            for ( int x = 0; x < depthImg.cols; x += 4 ) {
+                if ( depth[ x ] == 0 || last[ x ] == 0 )
+                    continue;
+                change += std::abs( int( depth[ x ] ) - int( last[ x ] ) );
+                n++;
+            }
+        }
+
+        moved = n == 0 || change / n / 1000.0 > threshold;
+    }
+
+    depthImg.copyTo( lastDepth );
+    return moved;
+}
+
+// smoothing of the hough space in x, y and across the scales
+void CRForestDetector::smoothHoughSpace(std::vector< std::vector<cv::Mat> >& vImgDetect, int this_class, const Parameters& param) {
+
+    unsigned int nScales = param.scales.size();
 
-    // smoothing hough space
     int kernelSize = 3;
     float sigma = 0.5;
     std::vector< cv::Mat > smoothAcc( nScales );
@@ -1267,7 +1800,7 @@ void CRForestDetector::voteForCenter(const std::vector<cv::Mat>& vImgAssign, std
 
 }
 
-void CRForestDetector::detectObject(const cv::Mat &img, const cv::Mat &depthImg,  const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const std::vector< cv::Mat >& vImgAssign, const std::vector<cv::Mat>& classProbs,  const Parameters& p, int this_class, std::vector<Candidate >& candidates) {
+void CRForestDetector::detectObject(const cv::Mat &img, const cv::Mat &depthImg,  const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Mat& imgAssign, const std::vector<cv::Mat>& classProbs, const QueryFrames& frames, const Parameters& p, int this_class, std::vector<Candidate >& candidates, cv::Rect* focus) {
 
     std::vector<std::vector<cv::Mat> > vImgDetect(crForest->GetNumLabels());
     std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > > voterImages;
@@ -1278,13 +1811,20 @@ void CRForestDetector::detectObject(const cv::Mat &img, const cv::Mat &depthImg,
         vImgDetect[cNr].resize(p.scales.size());
         for(unsigned int scNr = 0; scNr < p.scales.size(); scNr++) {
 
-            vImgDetect[cNr][scNr] = cv::Mat::zeros( vImgAssign[0].rows, vImgAssign[0].cols, CV_32FC1);
+            vImgDetect[cNr][scNr] = cv::Mat::zeros( imgAssign.rows, imgAssign.cols, CV_32FC1);
         }
     }
 
     // vote for object center in hough space
     int tstart = clock();
-    voteForCenter( vImgAssign, vImgDetect, depthImg, voterImages, normals, p.scales, this_class, NULL, p.thresh_vote, classProbs, p, p.addPoseInformation, p.addScaleInformation);
+    voteForCenter( imgAssign, vImgDetect, depthImg, voterImages, normals, p.scales, this_class, focus, p.thresh_vote, classProbs, p, p.addPoseInformation, p.addScaleInformation);
+
+    // only one of houghSubset^2 pixel subsets votes in a frame, the votes of the past frames are kept with decay
+    float temporalDensity = float(std::max(1, p.houghSubset * p.houghSubset));
+    if ( p.houghDecay > 0 )
+        accumulateTemporalHough( vImgDetect, this_class, p.houghDecay, temporalDensity );
+
+    smoothHoughSpace( vImgDetect, this_class, p );
     cout << "\t Time for voting for center..\t" << (double)(clock() - tstart)/CLOCKS_PER_SEC << " sec" << endl;
 
     if( p.DEBUG ) {
@@ -1314,11 +1854,137 @@ void CRForestDetector::detectObject(const cv::Mat &img, const cv::Mat &depthImg,
 
     // detecting the peaks in the voting space to find the prominent center of the object
     tstart = clock();
-    detectCenterPeaks(candidates, vImgDetect, vImgAssign, voterImages, depthImg, img, p, this_class);
+    detectCenterPeaks(candidates, vImgDetect, imgAssign, voterImages, depthImg, img, p, this_class, p.houghDecay > 0 ? int(100 / temporalDensity) : 100);
     cout << "\t Time for detecting center...\t" << (double)(clock() - tstart)/CLOCKS_PER_SEC << " sec" << endl;
 
+    // without time left the candidates are returned with their center only
+    if ( deadlinePassed() ) {
+        cv::Point2f img_center( imgAssign.cols/2.f, imgAssign.rows/2.f );
+        for ( unsigned int cand = 0; cand < candidates.size(); cand++ )
+            centerPose( candidates[ cand ], img_center );
+        cout << "\t deadline reached, pose estimation skipped" << endl;
+        return;
+    }
+
     // detecting pose of the found candidates
-    tstart = clock();
-    voteForPose( img, depthImg, voterImages, vImgAssign, vImgDetect, candidates, vImg, normals, p.kernel_width[0], p.scales, p.thresh_detection, p.DEBUG, p.addPoseScore);
-    cout << "\t Time for detecting pose.....\t" << (double)(clock() - tstart)/CLOCKS_PER_SEC << " sec" << endl;
+    // pose estimation runs in parallel, clock() would sum up the time of all threads
+    int64 tickStart = cv::getTickCount();
+    voteForPose( img, depthImg, voterImages, imgAssign, vImgDetect, candidates, vImg, normals, p.kernel_width[0], p.scales, frames, p.thresh_detection, p.DEBUG, p.addPoseScore, p.smoothPoseSpace);
+    cout << "\t Time for detecting pose.....\t" << (double)(cv::getTickCount() - tickStart)/cv::getTickFrequency() << " sec" << endl;
+}
+
+// Coarse pass of the pyramid detection: the forest is evaluated on a grid with the stride coarseStride and the peaks above
+// the relaxed threshold coarseRelax * thresh_detection give the regions which are detected at full resolution.
+// regions[cNr] bounds the regions of class cNr, roiMask is the union of the regions of all classes
+void CRForestDetector::coarseRegions(const cv::Mat& img, const cv::Mat& depthImg, const vector<cv::Mat>& vImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Mat& gate, const Parameters& p, std::vector<cv::Rect>& regions, cv::Mat& roiMask) {
+
+    int stride = p.coarseStride;
+    float density = float(stride * stride);
+
+    cv::Mat grid = cv::Mat::zeros(img.rows, img.cols, CV_8UC1);
+    for (int y = 0; y < img.rows; y += stride)
+        for (int x = 0; x < img.cols; x += stride)
+            grid.at<uchar>(y, x) = 255;
+    if (!gate.empty())
+        grid &= gate;
+
+    cv::Mat imgAssign;
+    fullAssignCluster(img, depthImg, imgAssign, vImg, normals, p.cascadeTrees, p.cascadeThreshold, grid);
+
+    // the confidences and the votes come from 1/density of the pixels
+    std::vector<cv::Mat> classProbs;
+    getClassConfidence(imgAssign, classProbs);
+    for (unsigned int cNr = 0; cNr < classProbs.size(); cNr++)
+        classProbs[cNr] *= density;
+
+    Parameters param = p;
+    param.thresh_detection = p.coarseRelax * p.thresh_detection;
+    param.voteBudget = 0;
+
+    // the coarse pass votes without limit, the budget of the frame is left to the full resolution pass
+    int64 frameDeadline = deadline;
+    deadline = 0;
+
+    int nlabels = crForest->GetNumLabels();
+    cv::Rect imgRect(0, 0, img.cols, img.rows);
+    regions.assign(nlabels, cv::Rect());
+    roiMask = cv::Mat::zeros(img.rows, img.cols, CV_8UC1);
+
+    // the background is the last label
+    for (int cNr = 0; cNr < nlabels - 1; cNr++) {
+
+        int this_class = cNr;
+        std::vector<std::vector<cv::Mat> > vImgDetect(nlabels);
+        std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > > voterImages;
+
+        vImgDetect[cNr].resize(p.scales.size());
+        for (unsigned int scNr = 0; scNr < p.scales.size(); scNr++)
+            vImgDetect[cNr][scNr] = cv::Mat::zeros(imgAssign.rows, imgAssign.cols, CV_32FC1);
+
+        voteForCenter(imgAssign, vImgDetect, depthImg, voterImages, normals, p.scales, this_class, NULL, p.thresh_vote, classProbs, param, p.addPoseInformation, p.addScaleInformation);
+        for (unsigned int scNr = 0; scNr < p.scales.size(); scNr++)
+            vImgDetect[cNr][scNr] *= density;
+        smoothHoughSpace(vImgDetect, this_class, param);
+
+        std::vector<Candidate> candidates;
+        detectCenterPeaks(candidates, vImgDetect, imgAssign, voterImages, depthImg, img, param, this_class, int(100 / density));
+
+        // the pixels of an object lie within the projection of the half diagonal of its bounding box around the center
+        const cv::Point3f& bbSize = p.vbbSize[cNr];
+        float halfDiagonal = 0.5f * std::sqrt(bbSize.x * bbSize.x + bbSize.y * bbSize.y + bbSize.z * bbSize.z);
+
+        for (unsigned int cand = 0; cand < candidates.size(); cand++) {
+
+            int r = int(525.f * halfDiagonal * candidates[cand].scale) + 2 * stride;
+            cv::Rect roi = cv::Rect(int(candidates[cand].center.x) - r, int(candidates[cand].center.y) - r, 2 * r + 1, 2 * r + 1) & imgRect;
+            if (roi.area() == 0)
+                continue;
+
+            roiMask(roi).setTo(cv::Scalar(255));
+            regions[cNr] = regions[cNr].area() > 0 ? (regions[cNr] | roi) : roi;
+        }
+    }
+
+    if (!gate.empty())
+        roiMask &= gate;
+
+    deadline = frameDeadline;
+}
+
+// time the center voting in pixel order and grouped by leafs on one image, maxDifference is the largest difference of the two hough spaces
+void CRForestDetector::benchmarkCenterVoting(const cv::Mat& depthImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Mat& imgAssign, const std::vector<cv::Mat>& classProbs, const Parameters& p, int this_class, double& pixelOrderTime, double& leafOrderTime, float& maxDifference) {
+
+    Parameters param = p;
+    param.voteBudget = 0;
+    std::vector< std::vector< std::vector<cv::Mat> > > vImgDetect( 2, std::vector< std::vector<cv::Mat> >( crForest->GetNumLabels() ) );
+    double times[ 2 ];
+
+    for ( int order = 0; order < 2; order++ ) {
+
+        for ( unsigned int cNr = 0; cNr < crForest->GetNumLabels(); cNr++ ) {
+            if ( (this_class >= 0 ) && (this_class != (int)cNr) )
+                continue;
+            vImgDetect[ order ][ cNr ].resize( p.scales.size() );
+            for ( unsigned int scNr = 0; scNr < p.scales.size(); scNr++ )
+                vImgDetect[ order ][ cNr ][ scNr ] = cv::Mat::zeros( imgAssign.rows, imgAssign.cols, CV_32FC1 );
+        }
+
+        std::vector< std::vector< std::vector< std::vector< std::vector< std::pair< cv::Point, int > > > > > > voterImages;
+        param.leafGroupedVoting = ( order == 1 );
+
+        int64 tickStart = cv::getTickCount();
+        voteForCenter( imgAssign, vImgDetect[ order ], depthImg, voterImages, normals, p.scales, this_class, NULL, p.thresh_vote, classProbs, param, p.addPoseInformation, p.addScaleInformation );
+        times[ order ] = (double)(cv::getTickCount() - tickStart)/cv::getTickFrequency();
+    }
+
+    pixelOrderTime = times[ 0 ];
+    leafOrderTime = times[ 1 ];
+
+    maxDifference = 0.f;
+    for ( unsigned int cNr = 0; cNr < vImgDetect[ 0 ].size(); cNr++ ) {
+        for ( unsigned int scNr = 0; scNr < vImgDetect[ 0 ][ cNr ].size(); scNr++ ) {
+            double diff = cv::norm( vImgDetect[ 0 ][ cNr ][ scNr ], vImgDetect[ 1 ][ cNr ][ scNr ], cv::NORM_INF );
+            maxDifference = std::max( maxDifference, float( diff ) );
+        }
+    }
 }
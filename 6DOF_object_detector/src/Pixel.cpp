@@ -11,6 +11,7 @@
 
 #include "Pixel.h"
 #include <deque>
+#include <limits>
 
 using namespace std;
 
@@ -86,37 +87,70 @@ void CRPixel::extractPixels(const Parameters& param, const cv::Mat& img, const c
 //    }
 //    n = locations.size();
 
+    // the tests reach at most 0.4 * objectSize * scale pixels from a pixel (see generateTest in Tree.h),
+    // only the bounding box with this margin is kept of the channels and normals
+    float maxScale = 0;
+    for( unsigned int i = 0; i < n; i++ ) {
+        unsigned short depth = depthImg.at<unsigned short>( cv::Point( locations.at<int>(i,0), locations.at<int>(i,1) ) );
+        if( depth > 0 )
+            maxScale = std::max( maxScale, 1000.f / depth );
+    }
+    int marginX = int( 0.4f * param.objectSize.first * maxScale ) + 2;
+    int marginY = int( 0.4f * param.objectSize.second * maxScale ) + 2;
+    cv::Rect crop = cv::Rect( box->x - marginX, box->y - marginY, box->width + 2 * marginX, box->height + 2 * marginY ) & cv::Rect( 0, 0, img.cols, img.rows );
+
+    // the channels and normals are stored once per image, the pixels refer to them by index
+    int image = images.size();
+    images.push_back( TrainingImage() );
+    TrainingImage& trainingImage = images.back();
+    trainingImage.id = imageID;
+    trainingImage.width = img.cols;
+    trainingImage.height = img.rows;
+    trainingImage.crop = crop;
+
+    int n8 = 0, n16 = 0;
+    trainingImage.plane.resize( vImg.size() );
+    trainingImage.wide.resize( vImg.size() );
+    for( unsigned int c = 0; c < vImg.size(); ++c ) {
+        // the channels are packed into the 8 and 16 bit planes, a channel of another depth would be lost
+        CV_Assert( vImg[ c ].depth() == CV_8U || vImg[ c ].depth() == CV_16U );
+        trainingImage.wide[ c ] = vImg[ c ].depth() == CV_16U;
+        trainingImage.plane[ c ] = trainingImage.wide[ c ] ? n16++ : n8++;
+    }
+    trainingImage.planes8.create( n8 * crop.height, crop.width, CV_8UC1 );
+    trainingImage.planes16.create( n16 * crop.height, crop.width, CV_16UC1 );
+    for( unsigned int c = 0; c < vImg.size(); ++c ) {
+        cv::Mat& planes = trainingImage.wide[ c ] ? trainingImage.planes16 : trainingImage.planes8;
+        cv::Mat plane = planes.rowRange( trainingImage.plane[ c ] * crop.height, ( trainingImage.plane[ c ] + 1 ) * crop.height );
+        vImg[ c ]( crop ).copyTo( plane );
+    }
+
+    trainingImage.normals.create( crop.height, crop.width, CV_32FC3 );
+    for( int y = 0; y < crop.height; ++y ) {
+        cv::Vec3f* row = trainingImage.normals.ptr< cv::Vec3f >( y );
+        for( int x = 0; x < crop.width; ++x ) {
+            const pcl::Normal& normal = normals->at( crop.x + x, crop.y + y );
+            row[ x ] = cv::Vec3f( normal.normal_x, normal.normal_y, normal.normal_z );
+        }
+    }
+
     // reserve memory
-    unsigned int offset = vRPixels[label].size();
-    vRPixels[label].reserve(offset+n);
-    vImageIDs[label].reserve(offset+n);
+    SampleTable& table = samples[label];
+    table.reserve( table.size() + n );
 
     // save pixel features
     for( unsigned int i = 0; i < n ; i++ ) {
 
         cv::Point2f pt(locations.at<int>(i,0), locations.at<int>(i,1));
 
-        PixelFeature* pf = new PixelFeature;
-
-        vImageIDs[label].push_back(imageID); // assigning the image id to the Pixel
-
-        pf->pixelLocation = pt; // saving pixel location
-        pf->iWidth = img.cols; // image size
-        pf->iHeight = img.rows;
-        pf->bbox = *box; // saving Bounding box details
-
         float scalePt;
         if(depthImg.at<unsigned short>(pt) == 0)
             scalePt = FLT_MAX;
         else
             scalePt = (float)(1000.f/depthImg.at<unsigned short>(pt)); //scale is inverse of depth::depth value sampled pixel is in millimeter converted to meter
-        pf->scale = scalePt;
-
-//         if( bbSize3D != 0 )
-//             pf->bbSize3D = *bbSize3D;
-//         else
-//             pf->bbSize3D = cv::Point3f (0.f,0.f,0.f);
 
+        cv::Point3f disVector( 0.f, 0.f, 0.f );
+        cv::Vec4f orientation( 1.f, 0.f, 0.f, 0.f );
 
         // save all the information below for object class only
         if( vCenter!=0 ) {
@@ -132,21 +166,17 @@ void CRPixel::extractPixels(const Parameters& param, const cv::Mat& img, const c
 
             cv::Point3f rPt = P3toR3( pt, imgCenter, 1/scalePt );
 
-            pf->pixelLocation_real = rPt;
-            pf->disVector = rPt - rObjCenter;
-
-            pf->imgAppearance.resize(vImg.size());
-            pf->imgAppearance = vImg;
-            pf->normals = normals;
-            pf->transformationMatrixOC = *transformationMatrixOC;
+            disVector = rPt - rObjCenter;
 
-            CRPixel::calcObject2QueryPointTransformation(*pf);
+            Eigen::Matrix3d T_qC;
+            Eigen::Quaterniond disTransformation = CRPixel::calcObject2QueryPointTransformation( rPt, disVector, normals->at( pt.x, pt.y ), *transformationMatrixOC, T_qC );
 
-            if(pf->disTransformation.w()!=pf->disTransformation.w())
+            if(disTransformation.w()!=disTransformation.w())
                 continue;
+            orientation = cv::Vec4f( disTransformation.w(), disTransformation.x(), disTransformation.y(), disTransformation.z() );
 
             if(0)
-                drawTransformation(img_1, depthImg, *transformationMatrixOC, pf->T_qC, rPt);
+                drawTransformation(img_1, depthImg, *transformationMatrixOC, T_qC, rPt);
 
             // visualize 3D bounding box
             if(0) {
@@ -164,7 +194,11 @@ void CRPixel::extractPixels(const Parameters& param, const cv::Mat& img, const c
 
         }
 
-        vRPixels[label].push_back( pf );
+        table.image.push_back( image );
+        table.location.push_back( cv::Point_< short >( pt.x, pt.y ) );
+        table.scale.push_back( scalePt );
+        table.offset.push_back( disVector );
+        table.orientation.push_back( orientation );
 
         // debug visualize randomly generated pixels
         if( 0 ) {
@@ -181,14 +215,14 @@ void CRPixel::extractPixels(const Parameters& param, const cv::Mat& img, const c
         // debug visualize assignment of channel pointers
         if( 0 ) {
             for( unsigned int c = 0; c < vImg.size(); ++c ) {
-                cv::imshow( " debug ", pf->imgAppearance[ c ] );
+                cv::imshow( " debug ", vImg[ c ]( crop ) );
                 cv::waitKey( 0 );
             }
         }
     }
 }
 
-void CRPixel::extractFeatureChannels(const Parameters& param, const cv::Mat& img, const cv::Mat& depthImg, std::vector<cv::Mat>& vImg, pcl::PointCloud<pcl::Normal>::Ptr& normals) {
+void CRPixel::extractFeatureChannels(const Parameters& param, const cv::Mat& img, const cv::Mat& depthImg, std::vector<cv::Mat>& vImg, pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Point2f* principalPoint) {
 
     // 34 feature channels
     // 7 + 1: L, a, b, |I_x|, |I_y|, |I_xx|, |I_yy| + depth (currently using)
@@ -250,7 +284,7 @@ void CRPixel::extractFeatureChannels(const Parameters& param, const cv::Mat& img
     depthImg.copyTo( vImg[ 7 ] );
 
     // Compute Normals
-    computeNormals(img, depthImg, normals );
+    computeNormals(img, depthImg, normals, principalPoint );
 
     if(param.addHoG) {
 
@@ -295,14 +329,57 @@ void CRPixel::extractFeatureChannels(const Parameters& param, const cv::Mat& img
 
 }
 
-void CRPixel::computeNormals(const cv::Mat& img, const cv::Mat& depthImg, pcl::PointCloud<pcl::Normal>::Ptr& normals  ) {
+// The features of the crop are computed with the principal point of the full image, so the normals are the same as for
+// the full image apart from the border of the crop
+void CRPixel::extractFeatureChannels(const Parameters& param, const cv::Mat& img, const cv::Mat& depthImg, const cv::Rect& roi, std::vector<cv::Mat>& vImg, pcl::PointCloud<pcl::Normal>::Ptr& normals) {
+
+    cv::Rect crop = roi & cv::Rect(0, 0, img.cols, img.rows);
+    cv::Point2f principalPoint(img.cols/2.f - crop.x, img.rows/2.f - crop.y);
+
+    std::vector<cv::Mat> vCrop;
+    pcl::PointCloud<pcl::Normal>::Ptr cropNormals(new pcl::PointCloud<pcl::Normal>);
+    if (crop.area() > 0)
+        extractFeatureChannels(param, img(crop).clone(), depthImg(crop).clone(), vCrop, cropNormals, &principalPoint);
+
+    // same number and types of channels as for the full image
+    int total_channels = 8;
+    if( param.addHoG )
+        total_channels += 9 ;
+    if(param.addMinMaxFilt)
+        total_channels *= 2;
+
+    vImg.resize(total_channels);
+    for (int c = 0; c < total_channels; c++) {
+        if (c < int(vCrop.size())) {
+            vImg[c] = cv::Mat::zeros(img.rows, img.cols, vCrop[c].type());
+            vCrop[c].copyTo(vImg[c](crop));
+        } else
+            vImg[c] = cv::Mat::zeros(img.rows, img.cols, c == 7 ? depthImg.type() : CV_8UC1);
+    }
+
+    // organized normals of the full image, NaN outside of the crop
+    float nan = std::numeric_limits<float>::quiet_NaN();
+    pcl::Normal invalid;
+    invalid.normal_x = invalid.normal_y = invalid.normal_z = invalid.curvature = nan;
+
+    normals->width = img.cols;
+    normals->height = img.rows;
+    normals->is_dense = false;
+    normals->points.assign(img.rows * img.cols, invalid);
+
+    for (int y = 0; y < crop.height; y++)
+        for (int x = 0; x < crop.width; x++)
+            normals->points[(y + crop.y) * img.cols + x + crop.x] = cropNormals->points[y * crop.width + x];
+}
+
+void CRPixel::computeNormals(const cv::Mat& img, const cv::Mat& depthImg, pcl::PointCloud<pcl::Normal>::Ptr& normals, const cv::Point2f* principalPoint  ) {
 
     // Initialize the cloud
     pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
     pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> rgb(cloud);
 
     // Populate the cloud
-    Surfel::imagesToPointCloud( depthImg, img, cloud);
+    Surfel::imagesToPointCloud( depthImg, img, cloud, principalPoint);
 
     // Compute Normals
     pcl::IntegralImageNormalEstimation<pcl::PointXYZRGB, pcl::Normal> ne;
@@ -384,13 +461,66 @@ Eigen::Matrix3d CRPixel::calcQueryPoint2CameraTransformation(cv::Point3f& real_c
     return transformationQueryC;
 }
 
-void CRPixel::calcObject2QueryPointTransformation( PixelFeature &pf ) {
+void CRPixel::computeQueryFrames( const cv::Mat& depthImg, const pcl::PointCloud<pcl::Normal>::Ptr& normals, QueryFrames& frames ) {
+
+    frames.width = depthImg.cols;
+    frames.height = depthImg.rows;
+
+    int nPixels = frames.width * frames.height;
+    frames.location.resize( nPixels );
+    frames.normal.resize( nPixels );
+    frames.normalCrossLocation.resize( nPixels );
+    frames.valid.assign( nPixels, 0 );
+
+    cv::Point2f img_center( depthImg.cols / 2.f, depthImg.rows / 2.f );
+
+    for( int y = 0; y < depthImg.rows; y++ ) {
+        const int16_t* depthLine = depthImg.ptr< int16_t >( y );
+        for( int x = 0; x < depthImg.cols; x++ ) {
+
+            int idx = y * depthImg.cols + x;
+
+            cv::Point2f pt( x, y );
+            cv::Point3f real = P3toR3( pt, img_center, depthLine[ x ] / 1000.f );
+            frames.location[ idx ] = Eigen::Vector3f( real.x, real.y, real.z );
+
+            pcl::Normal q_n = normals->at( x, y );
+            if( q_n.normal_x != q_n.normal_x )
+                continue;
+
+            frames.normal[ idx ] = q_n.getNormalVector3fMap();
+            frames.normal[ idx ].normalize();
+            frames.normalCrossLocation[ idx ] = frames.normal[ idx ].cross( frames.location[ idx ] );
+            frames.valid[ idx ] = 1;
+        }
+    }
+}
+
+Eigen::Matrix3d CRPixel::calcQueryPoint2CameraTransformation( const QueryFrames& frames, int idx, const Eigen::Vector3f& object_center ) {
+
+    // normal x (center - location), the length of the displacement does not matter since u is normalized
+    Eigen::Vector3f u = frames.normal[ idx ].cross( object_center ) - frames.normalCrossLocation[ idx ];
+    u.normalize();
+
+    Eigen::Vector3f v = frames.normal[ idx ].cross( u );
+
+    // left-handed coordinate system
+    Eigen::Matrix3d transformationQueryC;
+    transformationQueryC.block<3,1>(0,0) = u.cast<double>();
+    transformationQueryC.block<3,1>(0,1) = v.cast<double>();
+    transformationQueryC.block<3,1>(0,2) = frames.normal[ idx ].cast<double>();
+
+    return transformationQueryC;
+}
+
+Eigen::Quaterniond CRPixel::calcObject2QueryPointTransformation( const cv::Point3f& real_coordinate, const cv::Point3f& disVector, const pcl::Normal& normal, const Eigen::Matrix4d& transformationMatrixOC, Eigen::Matrix3d& T_qC ) {
 
-    cv::Point3f object_center = pf.pixelLocation_real - pf.disVector;
-    pf.T_qC = CRPixel::calcQueryPoint2CameraTransformation( pf.pixelLocation_real, object_center, pf.normals->at( pf.pixelLocation.x, pf.pixelLocation.y ) );
-    Eigen::Matrix3d T_Oq = pf.T_qC.inverse() * pf.transformationMatrixOC.block< 3, 3 >( 0, 0 );
+    cv::Point3f location = real_coordinate;
+    cv::Point3f object_center = real_coordinate - disVector;
+    T_qC = CRPixel::calcQueryPoint2CameraTransformation( location, object_center, normal );
+    Eigen::Matrix3d T_Oq = T_qC.inverse() * transformationMatrixOC.block< 3, 3 >( 0, 0 );
 
-    pf.disTransformation = Eigen::Quaterniond( T_Oq );
+    return Eigen::Quaterniond( T_Oq );
 
 }
 
@@ -8,7 +8,8 @@
 
 using namespace std;
 
-void Surfel::imagesToPointCloud( const cv::Mat& depthImg, const cv::Mat& colorImg, pcl::PointCloud< pcl::PointXYZRGB >::Ptr& cloud) {
+// the principal point is the image center unless it is given, e.g. for a part cropped out of a larger image
+void Surfel::imagesToPointCloud( const cv::Mat& depthImg, const cv::Mat& colorImg, pcl::PointCloud< pcl::PointXYZRGB >::Ptr& cloud, const cv::Point2f* principalPoint) {
 
     //cloud->header = depthImg.header;//
     cloud->is_dense = true;
@@ -20,8 +21,8 @@ void Surfel::imagesToPointCloud( const cv::Mat& depthImg, const cv::Mat& colorIm
     cloud->points.resize( colorImg.rows * colorImg.cols ) ;
 
     const float invfocalLength = 1.f / 525.f;
-    const float centerX = colorImg.cols / 2.f;
-    const float centerY = colorImg.rows / 2.f;
+    const float centerX = principalPoint ? principalPoint->x : colorImg.cols / 2.f;
+    const float centerY = principalPoint ? principalPoint->y : colorImg.rows / 2.f;
 
     //   const float* depthdata = reinterpret_cast<const float*>(&depthImg.data[0]);
     //   const unsigned char* colordata = &colorImg.data[0];
@@ -270,8 +271,10 @@ void Surfel::houghPointCloud( std::vector< cv::Mat >& houghImg,  const std::vect
 
 void Surfel::computeSurfel(pcl::PointCloud<pcl::Normal>::Ptr normals, cv::Point2f pt1, cv::Point2f pt2, cv::Point2f center, SurfelFeature &sf, float depth1, float depth2) {
 
-    pcl::Normal n1 = normals->at(pt1.x, pt1.y);
-    pcl::Normal n2 = normals->at(pt2.x, pt2.y);
+    computeSurfel(normals->at(pt1.x, pt1.y), normals->at(pt2.x, pt2.y), pt1, pt2, center, sf, depth1, depth2);
+}
+
+void Surfel::computeSurfel(const pcl::Normal& n1, const pcl::Normal& n2, cv::Point2f pt1, cv::Point2f pt2, cv::Point2f center, SurfelFeature &sf, float depth1, float depth2) {
 
     Eigen::Vector3d v1 = n1.getNormalVector3fMap().cast<double>();
     Eigen::Vector3d v2 = n2.getNormalVector3fMap().cast<double>();
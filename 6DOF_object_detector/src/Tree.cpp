@@ -14,6 +14,7 @@
 #include <fstream>
 #include <algorithm>
 #include <limits.h>
+#include <sstream>
 
 
 using namespace std;
@@ -232,91 +233,119 @@ bool CRTree::loadHierarchy(const char* filename) {
 /////////////////////// Training Function /////////////////////////////
 
 // Start grow tree
-void CRTree::growTree( const Parameters& param, const CRPixel& TrData, int samples, int trNr, std::vector< std::vector< int > > numbers ) {
+void CRTree::growTree( const Parameters& param, const CRPixel& TrData, int samples, int trNr, std::vector< std::vector< int > >& numbers ) {
 
-    // Get inverse numbers of pixels
-    vector<float> vRatio(numbers.size());
+    // the permutation holds the indices of the pixels in the sample tables of TrData, it is the only
+    // training set of the tree, the nodes are ranges of it
+    int64 tick = cv::getTickCount();
+    trainingData = &TrData;
+    sampleOrder.swap( numbers );
 
-    vector<vector< PixelFeature*> > TrainSet( numbers.size() );
-    vector<vector<int> > TrainIDs(numbers.size());
-    dynFeatureSet.resize(numbers.size());
+    // Get inverse numbers of pixels
+    vector<float> vRatio(sampleOrder.size());
 
-    for( unsigned int l = 0; l < numbers.size(); ++l ) { // l is nlabels of each class
-        TrainSet[l].reserve( numbers[l].size() );
-        TrainIDs[l].reserve( numbers[l].size() );
-        dynFeatureSet[l].reserve( numbers[l].size() );
+    for( unsigned int l = 0; l < sampleOrder.size(); ++l ) { // l is nlabels of each class
 
-        if ( numbers.size() > 1 ) {
-            vRatio[l] = 1.0f/(float)numbers[l].size();
+        if ( sampleOrder.size() > 1 ) {
+            vRatio[l] = 1.0f/(float)sampleOrder[l].size();
         } else {
             vRatio[l] = 0.0f;
         }
-        for(std::vector< int >::iterator number = numbers[l].begin(); number != numbers[l].end(); number++ ) {
+    }
+    double setTime = (cv::getTickCount() - tick) / cv::getTickFrequency();
 
-            PixelFeature* pf = new PixelFeature;
-            pf = TrData.vRPixels[l][*number];
+    // Grow tree
+    grow( param, samples, vRatio , trNr );
 
-            TrainSet[l].push_back(pf);
+    tick = cv::getTickCount();
+    vector< vector< int > >().swap( sampleOrder );
+    setTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
 
-            DynamicFeature* df = new DynamicFeature;
-            df->alpha.reserve(max_depth);
-            dynFeatureSet[l].push_back(df);
-        }
-    }
-    // Grow tree
-    grow( param, TrainSet, dynFeatureSet, TrainIDs, 0, 0, samples, vRatio , trNr );
+    std::ostringstream msg;
+    msg << "\t Time for the training sets of tree " << trNr << "\t" << setTime << " sec" << endl;
+    cout << msg.str();
 }
 
-// Called by growTree
-void CRTree::grow(const Parameters& param, const vector< vector< PixelFeature*> >& TrainSet, vector<vector< DynamicFeature*> >& dynFeatures, const vector<vector<int> >& TrainIDs, int node, unsigned int depth, int samples, vector<float>& vRatio, int trNr) {
+// Called by growTree: grows the tree level by level. The pixels of a node are a range of the permutation of
+// each class, a split partitions the range of the node in place into the ranges of its children.
+// The open nodes of a level are split first, nodes with more than 1/node_threads of the pixels of the level
+// one after the other with all threads on their tests, the other nodes in parallel with one thread each.
+// The children and leafs are then created in the order of the level, so the ids and the tree do not depend
+// on the number of threads
+void CRTree::grow(const Parameters& param, int samples, vector<float>& vRatio, int trNr) {
+
+    vector< GrowNode > level( 1 );
+    level[ 0 ].node = 0;
+    level[ 0 ].begin.assign( sampleOrder.size(), 0 );
+    level[ 0 ].end.resize( sampleOrder.size() );
+    for( unsigned int l = 0; l < sampleOrder.size(); ++l )
+        level[ 0 ].end[ l ] = sampleOrder[ l ].size();
+
+    for( unsigned int depth = 0; !level.empty(); ++depth ) {
+
+        int nOpen = level.size();
+        vector< GrowNode > childA( nOpen ), childB( nOpen );
+        vector< vector< int > > tests( nOpen, vector< int >( 6, 0 ) );
+        vector< char > found( nOpen, 0 );
+
+        if( depth < max_depth ) {
+
+            vector< long > sizes( nOpen, 0 );
+            long total = 0;
+            for( int n = 0; n < nOpen; ++n ) {
+                for( unsigned int l = 0; l < level[ n ].begin.size(); ++l )
+                    sizes[ n ] += level[ n ].size( l );
+                total += sizes[ n ];
+            }
 
-    if(depth < max_depth) {
-        vector<vector< PixelFeature*> > SetA;
-        vector<vector< PixelFeature*> > SetB;
-        vector<vector< DynamicFeature*> > dynA;
-        vector<vector< DynamicFeature*> > dynB;
-        vector<vector<int> > idA;
-        vector<vector<int> > idB;
+            vector< char > big( nOpen, 0 );
+            for( int n = 0; n < nOpen; ++n ) {
+                big[ n ] = node_threads > 1 && sizes[ n ] * node_threads > total;
+                if( big[ n ] )
+                    found[ n ] = splitNode( param, level[ n ], childA[ n ], childB[ n ], &tests[ n ][ 0 ], depth, samples, vRatio, trNr, node_threads );
+            }
 
-        int test[6];
+            #pragma omp parallel for schedule(dynamic) num_threads( node_threads )
+            for( int n = 0; n < nOpen; ++n ) {
+                if( !big[ n ] )
+                    found[ n ] = splitNode( param, level[ n ], childA[ n ], childB[ n ], &tests[ n ][ 0 ], depth, samples, vRatio, trNr, 1 );
+            }
+        }
 
-        // Set measure mode for split: -1         - classification,
-        //                             otherwise  - regression (for locations)
-        int stat[ TrainSet.size() ]; //stat has labels of all classes in the TrainSet
-        int count_stat = getStatSet( TrainSet, stat ); // nlables
+        vector< GrowNode > next;
+        for( int n = 0; n < nOpen; ++n ) {
 
-        cout << "SetSize: ";
-        for( unsigned int l = 0; l < TrainSet.size(); ++l )
-            cout << TrainSet[l].size() << " ";
-        cout << endl;
+            int node = level[ n ].node;
 
-        bool check_test = false;
-        int count_test = 0;
+            if( !found[ n ] ) {
 
-        while( !check_test ) {
-            int measure_mode = 0;
-            if( count_stat > 1 )
-                measure_mode = ( cvRNG->operator ()( 4 ) ) - 1;
-            else
-                measure_mode = ( cvRNG->operator ()( 2 ) ) + 1;
+                // maximum depth is reached or no split could be found (only invalid splits)
+                if( depth < max_depth )
+                    cout << "Invalid Test" << endl;
 
-            cout << "MeasureMode: " <<  measure_mode << ", Depth = " << depth << ", Tree: " << trNr << endl;
+                nodes[node].isLeaf = true;
+                nodes[node].leftChild = -1;
+                nodes[node].rightChild = -1;
+                nodes[node].data.resize(6,0);
+                // do not change the parent
+                makeLeaf(level[ n ], vRatio, node);
+                continue;
+            }
 
-            // Find optimal test
-            if( check_test = optimizeTest(param, SetA, SetB, dynA, dynB, idA, idB, TrainSet, dynFeatures, TrainIDs,  test, samples, measure_mode, vRatio, node) ) {
+            // Store binary test for current node
+            InternalNode* ptT = &nodes[node];
+            ptT->data.resize(6);
+            for( int t = 0; t < 6; ++t)
+                ptT->data[t] = tests[ n ][ t ];
 
-                // Store binary test for current node
-                InternalNode* ptT = &nodes[node];
-                ptT->data.resize(6);
-                for( int t = 0; t < 6; ++t)
-                    ptT->data[t] = test[t];
+            // left child from set A, right child from set B
+            for( int side = 0; side < 2; ++side ) {
 
-                double countA = 0;
-                double countB = 0;
-                for(unsigned int l=0; l<TrainSet.size(); ++l) {
-                    countA += SetA[l].size();
-                    countB += SetB[l].size();
-                }
+                GrowNode& child = side == 0 ? childA[ n ] : childB[ n ];
+
+                double count = 0;
+                for(unsigned int l=0; l<child.begin.size(); ++l)
+                    count += child.size( l );
 
                 //make an empty node and push it to the tree
                 InternalNode temp;
@@ -325,72 +354,77 @@ void CRTree::grow(const Parameters& param, const vector< vector< PixelFeature*>
                 temp.parent = node;
                 temp.data.resize(6,0);
                 temp.depth = depth +1;
-
-                // Go left
                 temp.idN = nodes.size();
-                nodes[node].leftChild = temp.idN;
+
+                if( side == 0 )
+                    nodes[node].leftChild = temp.idN;
+                else
+                    nodes[node].rightChild = temp.idN;
 
                 // If enough patches are left continue growing else stop
-                if(countA > min_samples) {
+                if(count > min_samples) {
                     temp.isLeaf = false;
                     nodes.push_back(temp);
                     num_nodes +=1;
-                    grow(param, SetA, dynA, idA, temp.idN, depth+1, samples, vRatio, trNr);
+
+                    next.resize( next.size() + 1 );
+                    next.back().node = temp.idN;
+                    next.back().begin.swap( child.begin );
+                    next.back().end.swap( child.end );
                 } else {
                     // the leaf id will be assigned to the left child in the makeLeaf
                     // isLeaf will be set to true
                     temp.isLeaf = true;
                     nodes.push_back(temp);
                     num_nodes +=1;
-                    makeLeaf(SetA, dynA, idA, vRatio, temp.idN);
+                    makeLeaf(child, vRatio, temp.idN);
                 }
+            }
+        }
 
-                // Go right
-                temp.idN = nodes.size();
-                nodes[node].rightChild = temp.idN;
-                // If enough patches are left continue growing else stop
-                if(countB > min_samples) {
-                    temp.isLeaf = false;
-                    nodes.push_back(temp);
-                    num_nodes += 1;
-                    grow(param, SetB,dynB, idB, temp.idN, depth+1, samples, vRatio, trNr);
-                } else {
-                    temp.isLeaf = true;
-                    nodes.push_back(temp);
-                    num_nodes +=1;
-                    makeLeaf(SetB, dynB, idB, vRatio, temp.idN);
-                }
+        level.swap( next );
+    }
+}
 
-            } else {
+// Finds the test of an open node with the random stream of the node, up to 4 measure modes are tried
+bool CRTree::splitNode(const Parameters& param, GrowNode& open, GrowNode& childA, GrowNode& childB, int* test, unsigned int depth, int samples, const vector<float>& vRatio, int trNr, int threads) {
 
-                if(++count_test>3) {
-                    cout << "Invalid Test" << endl;
+    StreamRNG nodeRNG = rng.stream( open.node );
 
-                    // Could not find split (only invalid splits)
-                    nodes[node].isLeaf = true;
-                    nodes[node].leftChild = -1;
-                    nodes[node].rightChild = -1;
-                    nodes[node].data.resize(6,0);
-                    makeLeaf(TrainSet, dynFeatures, TrainIDs, vRatio, node);
+    // Set measure mode for split: -1         - classification,
+    //                             otherwise  - regression (for locations)
+    vector< int > stat( open.begin.size() ); //stat has labels of all classes in the node
+    int count_stat = getStatSet( open, &stat[ 0 ] ); // nlables
 
-                    check_test = true;
-                }
-            }
-        }
-    } else {
-        // maximum depth is reached
-        nodes[node].isLeaf = true;
-        nodes[node].leftChild = -1;
-        nodes[node].rightChild = -1;
-        nodes[node].data.resize(6,0);
-        // do not change the parent
-        makeLeaf(TrainSet, dynFeatures, TrainIDs, vRatio, node);
-    }
+    // one string per line, the nodes of a level are printed from several threads
+    std::ostringstream sizes;
+    sizes << "SetSize: ";
+    for( unsigned int l = 0; l < open.begin.size(); ++l )
+        sizes << open.size( l ) << " ";
+    sizes << endl;
+    cout << sizes.str();
+
+    for( int count_test = 0; count_test < 4; ++count_test ) {
+
+        int measure_mode = 0;
+        if( count_stat > 1 )
+            measure_mode = ( nodeRNG( 4 ) ) - 1;
+        else
+            measure_mode = ( nodeRNG( 2 ) ) + 1;
 
+        std::ostringstream mode;
+        mode << "MeasureMode: " <<  measure_mode << ", Depth = " << depth << ", Tree: " << trNr << endl;
+        cout << mode.str();
+
+        // Find optimal test
+        if( optimizeTest(param, open, childA, childB, test, samples, measure_mode, vRatio, nodeRNG, threads) )
+            return true;
+    }
+    return false;
 }
 
 // Create leaf node from patches
-void CRTree::makeLeaf(const std::vector<std::vector< PixelFeature*> >& TrainSet, const std::vector<std::vector< DynamicFeature*> >& dynFeatures, const std::vector<std::vector< int> >& TrainIDs, std::vector<float>& vRatio, int node) {
+void CRTree::makeLeaf(const GrowNode& leaf, std::vector<float>& vRatio, int node) {
 
     // setting the leaf pointer
     nodes[node].leftChild = num_leaf;
@@ -400,34 +434,35 @@ void CRTree::makeLeaf(const std::vector<std::vector< PixelFeature*> >& TrainSet,
     L.depth = nodes[node].depth;
     L.parent = nodes[node].parent;
 
-    L.vCenter.resize(TrainSet.size());
-    L.vPrLabel.resize(TrainSet.size());
-//     L.bbSize3D.resize(TrainSet.size());
-    L.vOrientation.resize(TrainSet.size());
+    unsigned int nlabels = leaf.begin.size();
+    L.vCenter.resize(nlabels);
+    L.vPrLabel.resize(nlabels);
+//     L.bbSize3D.resize(nlabels);
+    L.vOrientation.resize(nlabels);
 
     // Store data
     float invsum = 0;
     float invsum_pos = 0;
-    for(unsigned int l=0; l<TrainSet.size(); ++l) {
+    for(unsigned int l=0; l<nlabels; ++l) {
 
-        L.vPrLabel[l] = (float)TrainSet[l].size() * vRatio[l];
+        int n = leaf.size(l);
+        L.vPrLabel[l] = (float)n * vRatio[l];
         invsum += L.vPrLabel[l];
 
         if (class_id[l] > 0)
             invsum_pos += L.vPrLabel[l];
 
-        L.vCenter[l].resize( TrainSet[l].size() );
-//         L.bbSize3D[l].resize(TrainSet[l].size());
-        L.vOrientation[l].resize(TrainSet[l].size());
-
-        for(unsigned int i = 0; i<TrainSet[l].size(); ++i) {
-
-            L.vCenter[l][i] = TrainSet[l][i]->disVector;
-//             L.bbSize3D[l][i] = TrainSet[l][i]->bbSize3D;
-            L.vOrientation[l][i] = TrainSet[l][i]->disTransformation;
+        L.vCenter[l].resize( n );
+//         L.bbSize3D[l].resize(n);
+        L.vOrientation[l].resize(n);
 
-            delete dynFeatures[l][i];
+        const SampleTable& table = trainingData->samples[l];
+        for(int i = 0; i<n; ++i) {
 
+            int sample = sampleOrder[l][ leaf.begin[l] + i ];
+            L.vCenter[l][i] = table.offset[ sample ];
+            const cv::Vec4f& q = table.orientation[ sample ];
+            L.vOrientation[l][i] = Eigen::Quaterniond( q[0], q[1], q[2], q[3] );
         }
     }
 
@@ -435,12 +470,12 @@ void CRTree::makeLeaf(const std::vector<std::vector< PixelFeature*> >& TrainSet,
     invsum = 1.0f/invsum;
     if (invsum_pos > 0) {
         invsum_pos = 1.0f/invsum_pos;
-        for(unsigned int l = 0; l < TrainSet.size(); ++l) {
+        for(unsigned int l = 0; l < nlabels; ++l) {
             L.vPrLabel[l] *= invsum;
         }
         L.cL = invsum/invsum_pos;
     } else { // there is no positive patch in this leaf
-        for(unsigned int l=0; l < TrainSet.size(); ++l) {
+        for(unsigned int l=0; l < nlabels; ++l) {
             L.vPrLabel[l] *= invsum;
         }
         L.cL = 0.0f;
@@ -452,454 +487,463 @@ void CRTree::makeLeaf(const std::vector<std::vector< PixelFeature*> >& TrainSet,
     ++num_leaf;
 }
 
-bool CRTree::optimizeTest(const Parameters& param, vector< std::vector< PixelFeature* > >& SetA, vector< std::vector< PixelFeature* > >& SetB, vector< std::vector< DynamicFeature* > >& dynA, vector< std::vector< DynamicFeature* > >& dynB, vector< std::vector< int > >& idA, vector< std::vector< int > >& idB, const vector< std::vector< PixelFeature* > >& TrainSet, vector< std::vector< DynamicFeature* > >& dynFeatures, const vector< std::vector< int > >& TrainIDs, int* test, unsigned int iter, unsigned int measure_mode, const std::vector< float >& vRatio, int node) {
+bool CRTree::optimizeTest(const Parameters& param, GrowNode& open, GrowNode& childA, GrowNode& childB, int* test, unsigned int iter, unsigned int measure_mode, const std::vector< float >& vRatio, StreamRNG& nodeRNG, int threads) {
 
     bool found = false;
-    int subsample = 1000*TrainSet.size();
+    unsigned int nlabels = open.begin.size();
+    int subsample = 1000*nlabels;
 
     // sampling pixels proportional to the class to keep the balance of the classes
     std::vector<int> subsample_perclass;
-    subsample_perclass.resize(TrainSet.size(),0);
+    subsample_perclass.resize(nlabels,0);
     // first find out how many pixels are there
     int all_patches = 0;
-    for (unsigned int sz=0; sz < TrainSet.size(); sz++)
-        all_patches += TrainSet[sz].size();
+    for (unsigned int sz=0; sz < nlabels; sz++)
+        all_patches += open.size(sz);
     // the calculate the sampling rate for each set
     float sample_rate = float(subsample)/float(all_patches);
-    for ( unsigned int sz=0; sz < TrainSet.size(); sz++) {
-        subsample_perclass[sz] = int(sample_rate*float(TrainSet[sz].size()));
+    for ( unsigned int sz=0; sz < nlabels; sz++) {
+        subsample_perclass[sz] = int(sample_rate*float(open.size(sz)));
     }
-    // now we can subsample the patches and their associated ids
-    vector< vector< PixelFeature*> > tmpTrainSet;
-    vector< vector< int > > tmpTrainIDs;
-    vector< vector< DynamicFeature* > > tmpDynFeatures;
-    tmpDynFeatures.resize(TrainSet.size());
-    tmpTrainSet.resize(TrainSet.size());
-    tmpTrainIDs.resize(TrainSet.size());
+    // now we can subsample the patches
+    vector< vector< int> > tmpTrainSet;
+    tmpTrainSet.resize(nlabels);
 
     // sample the patches in a regular grid and copy them to the tree
-    for (unsigned int sz=0; sz < TrainSet.size() ; sz++) {
-        tmpTrainSet[sz].resize(std::min(int(TrainSet[sz].size()),subsample_perclass[sz]));
-        tmpTrainIDs[sz].resize(tmpTrainSet[sz].size());
-        tmpDynFeatures[sz].resize(tmpTrainSet[sz].size());
+    for (unsigned int sz=0; sz < nlabels ; sz++) {
+        tmpTrainSet[sz].resize(std::min(open.size(sz),subsample_perclass[sz]));
         if (tmpTrainSet[sz].size()==0)
             continue;
 
-        float float_rate = float(TrainSet[sz].size())/float(tmpTrainSet[sz].size());
-        for (unsigned int j=0; j < tmpTrainSet[sz].size(); j++) {
-            tmpTrainSet[sz][j] = TrainSet[sz][int(float_rate*j)];
-            tmpTrainIDs[sz][j] = TrainIDs[sz][int(float_rate*j)];
-            tmpDynFeatures[sz][j] = dynFeatures[sz][int(float_rate*j)];
-        }
+        float float_rate = float(open.size(sz))/float(tmpTrainSet[sz].size());
+        for (unsigned int j=0; j < tmpTrainSet[sz].size(); j++)
+            tmpTrainSet[sz][j] = sampleOrder[sz][open.begin[sz] + int(float_rate*j)];
     }
 
-    double tmpDist;
     double bestDist = -DBL_MAX;
-    int tmpTest[6];
+    int bestIndex = -1;
 
     // find non-empty class
     int check_label = 0;
     while(check_label<(int)tmpTrainSet.size() && tmpTrainSet[check_label].size()==0)
         ++check_label;
 
+    // the thresholds are searched on a histogram of the test values (thresholdBins > 0) or among all values
+    // (thresholdBins < 0), for the pose measure on the orientation statistics
+    bool pose = param.addPoseMeasure && measure_mode == 1;
+    bool histogram = param.thresholdBins > 0;
+    bool sweep = param.thresholdBins < 0;
+
+    // each test draws from a stream of its own, so the result does not depend on the number of threads;
+    // the streams are new for each call, as a node may be optimized again with another measure mode
+    StreamRNG testsRNG = nodeRNG.stream( nodeRNG.next64() );
+    vector< int > tests( iter * 6 );
+
     // Find best test of ITER iterations
-    for(unsigned int i =0; i<iter; ++i) {
-        // temporary data for split into Set A and Set B
-        vector<vector< PixelFeature*> > tmpA(tmpTrainSet.size());
-        vector<vector< PixelFeature*> > tmpB(tmpTrainSet.size());
-        vector<vector< DynamicFeature*> > dynA(tmpDynFeatures.size());
-        vector<vector< DynamicFeature*> > dynB(tmpDynFeatures.size());
-        vector<vector<int> > tmpIDA(tmpTrainIDs.size());
-        vector<vector<int> > tmpIDB(tmpTrainIDs.size());
+#pragma omp parallel num_threads( threads )
+    {
+        // best test of this thread
+        double threadDist = -DBL_MAX;
+        int threadIndex = -1;
+        int threadThreshold = 0;
+
+        // temporary data for split into Set A and Set B, the buffers of a thread are reused by all its tests
+        vector<vector< int> > tmpA(tmpTrainSet.size());
+        vector<vector< int> > tmpB(tmpTrainSet.size());
 
         // temporary data for finding best test
         vector<vector<IntIndex> > tmpValSet(tmpTrainSet.size());
-        // generate binary test without threshold
-        generateTest(param, &tmpTest[0], class_size[0].first, class_size[0].second, tmpTrainSet[check_label][0]->imgAppearance.size());
-
-        // compute value for each patch
-        evaluateTest( tmpValSet, &tmpTest[0], tmpTrainSet, tmpDynFeatures, node,  param.addPoseMeasure);
 
-        // find min/max values for threshold
-        int vmin = INT_MAX;
-        int vmax = INT_MIN;
-        for(unsigned int l = 0; l<tmpTrainSet.size(); ++l) {
-            if(tmpValSet[l].size()>0) {
-                if(vmin>tmpValSet[l].front().val)  vmin = tmpValSet[l].front().val;
-                if(vmax<tmpValSet[l].back().val )  vmax = tmpValSet[l].back().val;
+#pragma omp for schedule(dynamic)
+        for(int i = 0; i < (int)iter; ++i) {
+            StreamRNG testRNG = testsRNG.stream( i );
+            int* tmpTest = &tests[ i * 6 ];
+            double tmpDist;
+
+            // generate binary test without threshold
+            generateTest(param, tmpTest, class_size[0].first, class_size[0].second, trainingData->images[0].channels(), testRNG);
+
+            // compute value for each patch
+            for(unsigned int l = 0; l<tmpTrainSet.size(); ++l)
+                evaluateTest( tmpValSet[l], tmpTest, l, tmpTrainSet[l].empty() ? NULL : &tmpTrainSet[l][0], tmpTrainSet[l].size(), !histogram);
+
+            // find min/max values for threshold
+            int vmin = INT_MAX;
+            int vmax = INT_MIN;
+            for(unsigned int l = 0; l<tmpTrainSet.size(); ++l) {
+                for(vector<IntIndex>::const_iterator it = tmpValSet[l].begin(); it != tmpValSet[l].end(); ++it) {
+                    if(vmin>it->val)  vmin = it->val;
+                    if(vmax<it->val)  vmax = it->val;
+                }
             }
-        }
-        int d = vmax-vmin;
+            int d = vmax-vmin;
 
-        if(d > 0) {
+            if(d > 0 && (histogram || sweep)) {
 
-            // Find best threshold
-            for(unsigned int j=0; j < 10; ++j) {
+                // score all thresholds at once
+                int tr;
+                bool valid = histogram ? optimizeThreshold(param.thresholdBins, tmpValSet, tmpTrainSet, vmin, vmax, measure_mode, pose, vRatio, tmpDist, tr)
+                                       : optimizeThresholdSweep(tmpValSet, tmpTrainSet, measure_mode, pose, vRatio, tmpDist, tr);
+                if( valid && ( threadIndex < 0 || tmpDist > threadDist ) ) {
 
-                // Generate some random thresholds
-                int tr = (cvRNG->operator ()(d)) + vmin;
-
-                // Split training data into two sets A,B accroding to threshold t
-                split(tmpA, tmpB, dynA, dynB, tmpIDA, tmpIDB, tmpTrainSet, tmpDynFeatures, tmpTrainIDs, tmpValSet, tr);// include idA , idB, TrainIDs
-                int countA = 0;
-                int countB = 0;
-                for( int l = 0; l< (int)tmpTrainSet.size(); ++l) {
-                    if ((int)tmpA[l].size()> countA)
-                        countA = tmpA[l].size();
-                    if ((int)tmpB[l].size() > countB)
-                        countB = tmpB[l].size();
+                    threadDist = tmpDist;
+                    threadIndex = i;
+                    threadThreshold = tr;
                 }
 
-                // Do not allow empty set split (all patches end up in set A or B)
+            } else if(d > 0) {
 
-                if( countA>10 && countB>10 ) {
-                    // Measure quality of split with measure_mode 0 - classification, 1 - regression
-                    tmpDist = measureSet(tmpA, tmpB, dynA, dynB, measure_mode, vRatio, param.addPoseMeasure);
+                // Find best threshold
+                for(unsigned int j=0; j < 10; ++j) {
 
-                    // Take binary test with best split
-                    if(tmpDist > bestDist) {
+                    // Generate some random thresholds
+                    int tr = testRNG(d) + vmin;
 
-                        found = true;
-                        bestDist = tmpDist;
-                        for(int t=0; t<5; ++t) test[t] = tmpTest[t];
-                        test[5] = tr;
+                    // Split training data into two sets A,B accroding to threshold t
+                    split(tmpA, tmpB, tmpTrainSet, tmpValSet, tr);
+                    int countA = 0;
+                    int countB = 0;
+                    for( int l = 0; l< (int)tmpTrainSet.size(); ++l) {
+                        if ((int)tmpA[l].size()> countA)
+                            countA = tmpA[l].size();
+                        if ((int)tmpB[l].size() > countB)
+                            countB = tmpB[l].size();
                     }
-                }
-            } // end for
+
+                    // Do not allow empty set split (all patches end up in set A or B)
+
+                    if( countA>10 && countB>10 ) {
+                        // Measure quality of split with measure_mode 0 - classification, 1 - regression
+                        tmpDist = measureSet(tmpA, tmpB, measure_mode, vRatio, param.addPoseMeasure);
+
+                        // Take binary test with best split, the tests of a thread come in increasing order
+                        if( threadIndex < 0 || tmpDist > threadDist ) {
+
+                            threadDist = tmpDist;
+                            threadIndex = i;
+                            threadThreshold = tr;
+                        }
+                    }
+                } // end for
+            }
+        } // end iter
+
+        // reduction over the threads: the best split, on ties the first test as in a sequential search
+#pragma omp critical
+        {
+            if( threadIndex >= 0 && ( bestIndex < 0 || threadDist > bestDist || ( threadDist == bestDist && threadIndex < bestIndex ) ) ) {
+
+                bestDist = threadDist;
+                bestIndex = threadIndex;
+                for(int t=0; t<5; ++t) test[t] = tests[ threadIndex * 6 + t ];
+                test[5] = threadThreshold;
+            }
         }
-    } // end iter
+    }
+
+    found = bestIndex >= 0;
 
     if (found) {
-        // here we should evaluate the test on all the data
-        vector<vector<IntIndex> > valSet(TrainSet.size());
-        evaluateTest( valSet, &test[0], TrainSet, dynFeatures, node, false);
+        // here we should evaluate the test on all the data, in the order of the node
+        vector<vector<IntIndex> > valSet(nlabels);
+        for(unsigned int l = 0; l < nlabels; ++l)
+            evaluateTest( valSet[l], &test[0], l, nodeSamples(open, l), open.size(l), false);
         // now we can keep the best Test and split the whole set according to the best test and threshold
-        SetA.resize(TrainSet.size());
-        SetB.resize(TrainSet.size());
-        dynA.resize(TrainSet.size());
-        dynB.resize(TrainSet.size());
-        idA.resize(TrainSet.size());
-        idB.resize(TrainSet.size());
-        split(SetA, SetB, dynA, dynB, idA, idB, TrainSet, dynFeatures, TrainIDs, valSet, test[5]);
+        partition(open, valSet, test[5], childA, childB);
     }
     // return true if a valid test has been found
     // test is invalid if only splits with with members all less than 10 in set A or B has been created
     return found;
 }
 
-void CRTree::evaluateTest( vector< vector< IntIndex > >& valSet, const int* test, const vector< std::vector< PixelFeature* > >& TrainSet, vector< std::vector< DynamicFeature* > >& dynFeatures, int node, bool addPoseMeasure) {
+void CRTree::evaluateTest( vector< IntIndex >& values, const int* test, int l, const int* samples, int n, bool sortValues) {
 
-    for( unsigned int l = 0; l < TrainSet.size(); ++l ) {
-        valSet[ l ].resize( TrainSet[ l ].size() );
+    values.resize( n );
+    const SampleTable& table = trainingData->samples[ l ];
 
-        for( unsigned int i = 0; i < TrainSet[ l ].size(); ++i ) {
+    for( int i = 0; i < n; ++i ) {
 
-            //reconstruct pixel pair using vectors saved in test array
-            cv::Mat ptC;
-            cv::Point2f pt1,pt2;
-            const PixelFeature* pf = TrainSet[ l ][ i ];
-            DynamicFeature* df = dynFeatures[ l ][ i ];
+        //reconstruct pixel pair using vectors saved in test array
+        cv::Point2f pt1,pt2;
+        int s = samples[ i ];
+        const TrainingImage& image = trainingData->images[ table.image[ s ] ];
+        const cv::Rect& crop = image.crop;
+        const cv::Point_< short >& location = table.location[ s ];
+        float scale = table.scale[ s ];
 
+        // the crop of the image holds all pixels the tests can reach, only pixels without depth
+        // (scale FLT_MAX) are clamped to it instead of the image
+        pt1.x = std::max( crop.x, int( location.x + test[ 0 ] * scale ) );
+        pt1.x = std::min( int( pt1.x ), crop.x + crop.width - 1 );
 
-            pt1.x = std::max( int( 0.f /*pf->bbox.x */), int( pf->pixelLocation.x + test[ 0 ] * pf->scale ) );
-            pt1.x = std::min( int( pt1.x ), pf->iWidth /*pf->bbox.width + pf->bbox.x*/ - 1 );
+        pt1.y = std::max( crop.y, int(location.y + test[ 1 ] * scale ) );
+        pt1.y = std::min( int( pt1.y), crop.y + crop.height - 1 );
 
-            pt1.y = std::max( int( 0.f /*pf->bbox.y*/ ), int(pf->pixelLocation.y + test[ 1 ] * pf->scale ) );
-            pt1.y = std::min( int( pt1.y), pf->iHeight /*pf->bbox.height + pf->bbox.y*/ -1);
+        pt2.x = std::max( crop.x, int(location.x + test[ 2 ] * scale ) );
+        pt2.x = std::min( int( pt2.x), crop.x + crop.width - 1 );
 
-            pt2.x = std::max( int( 0.f /*pf->bbox.x*/ ), int(pf->pixelLocation.x + test[ 2 ] * pf->scale ) );
-            pt2.x = std::min( int( pt2.x), pf->iWidth /*pf->bbox.width + pf->bbox.x*/ -1);
+        pt2.y = std::max( crop.y, int( location.y + test[ 3 ] * scale ) );
+        pt2.y = std::min( int( pt2.y), crop.y + crop.height - 1 );
 
-            pt2.y = std::max( int( 0.f /*pf->bbox.y*/ ), int( pf->pixelLocation.y + test[ 3 ] * pf->scale ) );
-            pt2.y = std::min( int( pt2.y),  pf->iHeight /*pf->bbox.height + pf->bbox.y*/ -1 );
+        //debug
+        if(0) {
 
-            //debug
-            if(0) {
+            cv::Mat img_show;
+            cv::cvtColor( image.planes8.rowRange( 0, crop.height ), img_show, CV_GRAY2RGB );
+            cv::Point pixel = cv::Point( location ) - crop.tl();
 
-                cv::Mat img_show = cv::Mat( ptC.rows, ptC.cols, CV_8UC3,cv::Scalar(0) );
-                cv::cvtColor( pf->imgAppearance[ 0 ], img_show, CV_GRAY2RGB );
-                cv::Point pixel = pf->pixelLocation;
+            cv::circle(img_show, cv::Point( pt1 ) - crop.tl(), 1, CV_RGB( 255, 0, 0 ), 8, 8, 0);
+            cv::circle(img_show, cv::Point( pt2 ) - crop.tl(), 1, CV_RGB( 255, 0, 0 ), 8, 8, 0);
+            cv::circle(img_show, pixel, 1, CV_RGB( 0, 255, 0 ), 8, 8, 0);
+            cv::line(img_show, cv::Point( pt1 ) - crop.tl(), pixel, CV_RGB( 255, 0, 255 ), 2, 8, 0);
+            cv::line(img_show, cv::Point( pt2 ) - crop.tl(), pixel, CV_RGB( 255, 0, 255 ), 2, 8, 0);
+            cv::imshow("img",img_show);
+            cv::waitKey(0);
 
-                cv::circle(img_show, pt1, 1, CV_RGB( 255, 0, 0 ), 8, 8, 0);
-                cv::circle(img_show, pt2, 1, CV_RGB( 255, 0, 0 ), 8, 8, 0);
-                cv::circle(img_show, pixel, 1, CV_RGB( 0, 255, 0 ), 8, 8, 0);
-                cv::line(img_show,pt1, pixel, CV_RGB( 255, 0, 255 ), 2, 8, 0);
-                cv::line(img_show, pt2, pixel, CV_RGB( 255, 0, 255 ), 2, 8, 0);
-                cv::imshow("img",img_show);
-                cv::waitKey(0);
-
-            }
+        }
 
-            // if the channel is not Surfel feature
-            if( test[4] < pf->imgAppearance.size() && test[4] != 7 && test[4] != 15 && test[4] != 24 ) {
-                // pointer to channel
-                ptC = pf->imgAppearance[test[4]];
-                // get pixel values
-                int p1 = (int)(ptC.at<unsigned char>(pt1));
-                int p2 = (int)(ptC.at<unsigned char>(pt2));
-                valSet[l][i].val = p1 - p2;
-            } else if(test[4] == 7 || test[4] == 15 || test[4] == 24) {
-                // pointer to channel
-                ptC = pf->imgAppearance[test[4]];
-                // get pixel values
-                int p1 = (int)(ptC.at<unsigned short>(pt1));
-                int p2 = (int)(ptC.at<unsigned short>(pt2));
-                valSet[l][i].val = p1 - p2;
-            } else { // if the channel is Surfel feature
-
-                // calculate surfel feature
-                SurfelFeature sf;
-                Surfel::computeSurfel(pf->normals, cv::Point2f(pt1.x, pt1.y), cv::Point2f(pt2.x, pt2.y), cv::Point2f(pf->iWidth/2.f, pf->iHeight/2.f), sf, pf->imgAppearance[7].at<unsigned short>(pt1)/1000.f, pf->imgAppearance[7].at<unsigned short>(pt2)/1000.f  );
-                float  tempVal = sf.fVector[test[4] - TrainSet[l][i]->imgAppearance.size()];
-                if(isnan(tempVal)) {
-                    if(i == 0)
-                        tempVal = 0;
-                    else
-                        valSet[l][i-1].val;
-                }
-                valSet[l][i].val = tempVal;
-            }
+        // if the channel is not Surfel feature
+        if( test[4] < image.channels() ) {
+            // get pixel values
+            values[i].val = image.value( test[4], pt1 ) - image.value( test[4], pt2 );
+        } else { // if the channel is Surfel feature
+
+            // calculate surfel feature
+            SurfelFeature sf;
+            Surfel::computeSurfel(image.normal( pt1 ), image.normal( pt2 ), cv::Point2f(pt1.x, pt1.y), cv::Point2f(pt2.x, pt2.y), cv::Point2f(image.width/2.f, image.height/2.f), sf, image.value( 7, pt1 )/1000.f, image.value( 7, pt2 )/1000.f  );
+            // an undefined surfel feature (missing normal or depth) takes the value 0, the pixel before is
+            // an unrelated pixel of the class
+            float  tempVal = sf.fVector[test[4] - image.channels()];
+            if(isnan(tempVal))
+                tempVal = 0;
+            values[i].val = tempVal;
+        }
 
 
-            valSet[l][i].index = i;
-        }
-        sort( valSet[l].begin(), valSet[l].end() );
+        values[i].index = i;
     }
+    if( sortValues )
+        sort( values.begin(), values.end() );
 }
 
-void CRTree::split(vector< std::vector< PixelFeature* > >& SetA, vector< std::vector< PixelFeature* > >& SetB, vector< std::vector< DynamicFeature* > >& dynA,vector< std::vector< DynamicFeature* > >& dynB, std::vector< std::vector< int > >& idA, vector< std::vector< int > >& idB, const vector< std::vector< PixelFeature* > >& TrainSet, vector< std::vector< DynamicFeature* > >& dynFeatures, const vector< std::vector< int > >& TrainIDs, const vector< vector< IntIndex > >& valSet, int t) {
-
-    for(unsigned int l = 0; l<TrainSet.size(); ++l) {
-
-        // search largest value such that val<t
-        vector<IntIndex>::const_iterator it = valSet[l].begin();
-        while(it!=valSet[l].end() && it->val<t) {
-            ++it;
+// Finds the best threshold of a test among all its values. The sorted values of the classes are merged
+// and the pixels are moved one by one from set B to set A, each move updates the statistics in O(1).
+// With pose the splits are measured on the orientation statistics of the object classes
+bool CRTree::optimizeThresholdSweep(const vector< vector< IntIndex > >& valSet, const vector< std::vector< int > >& TrainSet, unsigned int measure_mode, bool pose, const std::vector< float >& vRatio, double& bestDist, int& threshold) {
+
+    unsigned int nlabels = TrainSet.size();
+
+    vector< SplitStats > statA( nlabels );
+    vector< SplitStats > statB( nlabels );
+    vector< RotationStats > rotA( nlabels );
+    vector< RotationStats > rotB( nlabels );
+    for(unsigned int l = 0; l < nlabels; ++l) {
+        for(vector< IntIndex >::const_iterator it = valSet[l].begin(); it != valSet[l].end(); ++it) {
+            statB[l].add( sampleOffset( l, TrainSet[l][it->index] ) );
+            if( pose && class_id[l] > 0 )
+                rotB[l].add( sampleOrientation( l, TrainSet[l][it->index] ) );
         }
+    }
 
-        SetA[l].resize(it-valSet[l].begin());
-        idA[l].resize(SetA[l].size());
-        dynA[l].resize(SetA[l].size());
-        SetB[l].resize(TrainSet[l].size()-SetA[l].size());
-        idB[l].resize(SetB[l].size());
-        dynB[l].resize(SetB[l].size());
+    // position of the first value of each class which is not in set A
+    vector< unsigned int > pos( nlabels, 0 );
+    bool found = false;
 
+    while( true ) {
 
-        it = valSet[l].begin();
-        for(unsigned int i=0; i<SetA[l].size(); ++i, ++it) {
-            SetA[l][i] = TrainSet[l][it->index];
-            idA[l][i] = TrainIDs[l][it->index];
-            dynA[l][i] = dynFeatures[l][it->index];
+        // the smallest value left is the next threshold
+        int t = INT_MAX;
+        bool left = false;
+        for(unsigned int l = 0; l < nlabels; ++l) {
+            if( pos[l] < valSet[l].size() && valSet[l][pos[l]].val <= t ) {
+                t = valSet[l][pos[l]].val;
+                left = true;
+            }
         }
-
-        it = valSet[l].begin()+SetA[l].size();
-        for(unsigned int i=0; i<SetB[l].size(); ++i, ++it) {
-            SetB[l][i] = TrainSet[l][it->index];
-            idB[l][i] = TrainIDs[l][it->index];
-            dynB[l][i] = dynFeatures[l][it->index];
-
+        if( !left )
+            break;
+
+        int countA = 0;
+        int countB = 0;
+        for(unsigned int l = 0; l < nlabels; ++l) {
+            countA = std::max( countA, statA[l].n );
+            countB = std::max( countB, statB[l].n );
         }
-    }
-}
-
-double CRTree::orientationMeanMC(const std::vector<std::vector< PixelFeature*> >& SetA, const std::vector<std::vector< PixelFeature*> >& SetB, const std::vector<std::vector< DynamicFeature*> >& dynA, const std::vector<std::vector< DynamicFeature*> >& dynB) {
-
-    vector<double> dist(num_labels, 0);
-
-    // For setA
-    Eigen::Quaterniond interpA1;
-    Eigen::Quaterniond interpA2;
-
-    vector< Eigen::Quaterniond > vTransA1;
-    vector< Eigen::Quaterniond > vTransA2;
-
-    //For setB
-    Eigen::Quaterniond interpB1;
-    Eigen::Quaterniond interpB2;
-
-    vector< Eigen::Quaterniond > vTransB1;
-    vector< Eigen::Quaterniond > vTransB2;
-
-
-    float sample_pose = 0.9; // ignore with this probability
-
-    for( unsigned int c = 0; c < num_labels; ++c ) {
-
-        if( class_id[ c ] > 0 ) { // only for object class
-
-            // For SetA
-            vTransA1.clear();
-            vTransA2.clear();
-
-            vTransA1.reserve(SetA[c].size());
-            vTransA2.reserve(SetA[c].size());
-            vector< DynamicFeature* >::const_iterator it_d = dynA[c].begin();
-            for(vector< PixelFeature* >::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it, ++it_d) { // for all training data of class c in SetA
-
-                cv::RNG rng(cv::getCPUTickCount());
-                float val = rng.uniform( 0.f, 1.f ); // generate a random number within [0,1]
 
-                if( val > sample_pose || SetA[c].size()*sample_pose < 100.f ) {
+        // Do not allow empty set split, as for the random thresholds
+        if( countA > 10 && countB > 10 ) {
 
-                    // 1 generate realtive transformation for first offset vector
-                    Eigen::Quaterniond t1 = (*it_d)->transformationMatrixOQuery_at_current_node.first;
-
-                    if(! ( isnan(t1.w()) || isnan(t1.x()) || isnan(t1.y()) || isnan(t1.z()) ) ) {
-                        // push quaternion into stack
-                        vTransA1.push_back(t1);
-
-                    }
-
-                    // 1 generate realtive transformation for first offset vector
-                    Eigen::Quaterniond t2 = (*it_d)->transformationMatrixOQuery_at_current_node.second;
-
-                    if(! ( isnan(t2.w()) || isnan(t2.x()) || isnan(t2.y()) || isnan(t2.z()) ) ) {
-                        // push quaternion into stack
-                        vTransA2.push_back(t2);
-                    }
-                }
+            double dist = pose ? -orientationMeanStats( rotA, rotB ) : measureStats( statA, statB, measure_mode, vRatio );
+            if( !found || dist > bestDist ) {
+                found = true;
+                bestDist = dist;
+                threshold = t;
             }
+        }
 
-            // find interpolation for both the stacks of relative transformation
-            interpA1 = quatInterp(vTransA1);
-            interpA2 = quatInterp(vTransA2);
-
-            Eigen::Quaterniond interpA1_inv = interpA1.inverse();
-            Eigen::Quaterniond interpA2_inv = interpA2.inverse();
-
-            // find dot product between mean and each quaternion and add it to dist
-            for(vector< PixelFeature* >::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it, ++it_d) { // for all training data of class c in Set
-
-                // 1 generate realtive transformation for first offset vector
-                Eigen::Quaterniond t1 = (*it_d)->transformationMatrixOQuery_at_current_node.first;
-
-                if(! ( isnan(t1.w()) || isnan(t1.x()) || isnan(t1.y()) || isnan(t1.z()) ) ) {
-                    // find difference between quaternions
-                    Eigen::Quaterniond diff = interpA1_inv * t1;
-
-                    // convert diff into axis angle
-                    Eigen::AngleAxisf diff_angleAxis(diff.cast<float>());
-
-                    dist[c] += diff_angleAxis.angle();
-
-                }
-
-                // 2 generate realtive transformation for second offset vector
-                Eigen::Quaterniond t2 = (*it_d)->transformationMatrixOQuery_at_current_node.second;
-
-                if(! ( isnan(t2.w()) || isnan(t2.x()) || isnan(t2.y()) || isnan(t2.z()) ) ) {
-                    // find difference between quaternions
-                    Eigen::Quaterniond diff = interpA2_inv * t2;
-
-                    // convert diff into axis angle
-                    Eigen::AngleAxisf diff_angleAxis(diff.cast<float>());
-
-                    dist[c] += diff_angleAxis.angle();
-
+        // the pixels with the value t go to set A
+        for(unsigned int l = 0; l < nlabels; ++l) {
+            for( ; pos[l] < valSet[l].size() && valSet[l][pos[l]].val == t; ++pos[l]) {
+                int sample = TrainSet[l][ valSet[l][pos[l]].index ];
+                const cv::Point3f& v = sampleOffset( l, sample );
+                statA[l].add( v );
+                statB[l].remove( v );
+                if( pose && class_id[l] > 0 ) {
+                    const cv::Vec4f& q = sampleOrientation( l, sample );
+                    rotA[l].add( q );
+                    rotB[l].remove( q );
                 }
-
             }
+        }
+    }
+    return found;
+}
 
+// Finds the best threshold of a test on the bin edges of a histogram of its values.
+// Each bin keeps the statistics of every class, so all thresholds are measured in one sweep
+// over the bins without sorting the values or splitting the sets. With pose the bins also keep the
+// orientation statistics of the object classes, which measure the splits
+bool CRTree::optimizeThreshold(int bins, const vector< vector< IntIndex > >& valSet, const vector< std::vector< int > >& TrainSet, int vmin, int vmax, unsigned int measure_mode, bool pose, const std::vector< float >& vRatio, double& bestDist, int& threshold) {
+
+    // bins of integer width, the value v falls into the bin (v - vmin) / width
+    int width = (vmax - vmin) / bins + 1;
+    int nbins = (vmax - vmin) / width + 1;
+    unsigned int nlabels = TrainSet.size();
+
+    vector< SplitStats > hist( nbins * nlabels );
+    vector< RotationStats > rotHist( pose ? nbins * nlabels : 0 );
+    for(unsigned int l = 0; l < nlabels; ++l) {
+        for(vector< IntIndex >::const_iterator it = valSet[l].begin(); it != valSet[l].end(); ++it) {
+            int bin = ((it->val - vmin) / width) * nlabels + l;
+            hist[ bin ].add( sampleOffset( l, TrainSet[l][it->index] ) );
+            if( pose && class_id[l] > 0 )
+                rotHist[ bin ].add( sampleOrientation( l, TrainSet[l][it->index] ) );
+        }
+    }
 
+    vector< SplitStats > total( nlabels );
+    vector< RotationStats > rotTotal( nlabels );
+    for(int b = 0; b < nbins; ++b) {
+        for(unsigned int l = 0; l < nlabels; ++l) {
+            total[l].add( hist[ b * nlabels + l ] );
+            if( pose )
+                rotTotal[l].add( rotHist[ b * nlabels + l ] );
+        }
+    }
 
-            // For SetB
-            vTransB1.clear();
-            vTransB2.clear();
-
-            vTransB1.reserve(SetB[c].size());
-            vTransB2.reserve(SetB[c].size());
-
-            for(vector< PixelFeature* >::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) { // for all training data of class c in SetA
-
-                cv::RNG rng(cv::getCPUTickCount());
-                float val = rng.uniform( 0.f, 1.f ); // generate a random number within [0,1]
-
-                if( val > sample_pose || SetB[c].size()*sample_pose < 100.f ) {
-
-                    // 1 generate realtive transformation for first offset vector
-                    Eigen::Quaterniond t1 = (*it_d)->transformationMatrixOQuery_at_current_node.first;
-
-                    if(! ( isnan(t1.w()) || isnan(t1.x()) || isnan(t1.y()) || isnan(t1.z()) ) ) {
-                        // push quaternion into stack
-                        vTransB1.push_back(t1);
-
-                    }
-
-                    // 2 generate realtive transformation for second offset vector
-                    Eigen::Quaterniond t2 = (*it_d)->transformationMatrixOQuery_at_current_node.second;
+    // set A holds the bins left of the edge (val < threshold), set B the rest
+    vector< SplitStats > statA( nlabels );
+    vector< SplitStats > statB( nlabels );
+    vector< RotationStats > rotA( nlabels );
+    vector< RotationStats > rotB( nlabels );
+    bool found = false;
 
-                    if(! ( isnan(t2.w()) || isnan(t2.x()) || isnan(t2.y()) || isnan(t2.z()) ) ) {
-                        // push quaternion into stack
-                        vTransB2.push_back(t2);
-                    }
-                }
+    for(int b = 1; b < nbins; ++b) {
+
+        int countA = 0;
+        int countB = 0;
+        for(unsigned int l = 0; l < nlabels; ++l) {
+            statA[l].add( hist[ (b - 1) * nlabels + l ] );
+            statB[l] = total[l];
+            statB[l].subtract( statA[l] );
+            countA = std::max( countA, statA[l].n );
+            countB = std::max( countB, statB[l].n );
+            if( pose ) {
+                rotA[l].add( rotHist[ (b - 1) * nlabels + l ] );
+                rotB[l] = rotTotal[l];
+                rotB[l].subtract( rotA[l] );
             }
+        }
 
-            // find interpolation for both the stacks of relative transformation
-            interpB1 = quatInterp(vTransB1);
-            interpB2 = quatInterp(vTransB2);
-
-            Eigen::Quaterniond interpB1_inv = interpB1.inverse();
-            Eigen::Quaterniond interpB2_inv = interpB2.inverse();
-
-            // find dot product between mean and each quaternion and add it to dist
-            for(vector< PixelFeature* >::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) { // for all training data of class c in Set
-
-                // 1 generate realtive transformation for first offset vector
-                Eigen::Quaterniond t1 = (*it_d)->transformationMatrixOQuery_at_current_node.first;
-
-                if(! ( isnan(t1.w()) || isnan(t1.x()) || isnan(t1.y()) || isnan(t1.z()) ) ) {
-                    // find difference between quaternions
-                    Eigen::Quaterniond diff = interpB1_inv * t1;
-
-                    // convert diff into axis angle
-                    Eigen::AngleAxisf diff_angleAxis(diff.cast<float>());
-
-                    dist[c] += diff_angleAxis.angle();
+        // Do not allow empty set split, as for the random thresholds
+        if( countA > 10 && countB > 10 ) {
 
-                }
-
-                // 2 generate realtive transformation for second offset vector
-                Eigen::Quaterniond t2 = (*it_d)->transformationMatrixOQuery_at_current_node.second;
+            double dist = pose ? -orientationMeanStats( rotA, rotB ) : measureStats( statA, statB, measure_mode, vRatio );
+            if( !found || dist > bestDist ) {
+                found = true;
+                bestDist = dist;
+                threshold = vmin + b * width;
+            }
+        }
+    }
+    return found;
+}
 
-                if(! ( isnan(t2.w()) || isnan(t2.x()) || isnan(t2.y()) || isnan(t2.z()) ) ) {
-                    // find difference between quaternions
-                    Eigen::Quaterniond diff = interpB2_inv * t2;
+void CRTree::split(vector< std::vector< int > >& SetA, vector< std::vector< int > >& SetB, const vector< std::vector< int > >& TrainSet, const vector< vector< IntIndex > >& valSet, int t) {
 
-                    // convert diff into axis angle
-                    Eigen::AngleAxisf diff_angleAxis(diff.cast<float>());
+    for(unsigned int l = 0; l<TrainSet.size(); ++l) {
 
-                    dist[c] += diff_angleAxis.angle();
+        // search largest value such that val<t
+        vector<IntIndex>::const_iterator it = valSet[l].begin();
+        while(it!=valSet[l].end() && it->val<t) {
+            ++it;
+        }
 
-                }
+        SetA[l].resize(it-valSet[l].begin());
+        SetB[l].resize(TrainSet[l].size()-SetA[l].size());
 
-            }
+        it = valSet[l].begin();
+        for(unsigned int i=0; i<SetA[l].size(); ++i, ++it)
+            SetA[l][i] = TrainSet[l][it->index];
 
-        }// end if for class check
+        it = valSet[l].begin()+SetA[l].size();
+        for(unsigned int i=0; i<SetB[l].size(); ++i, ++it)
+            SetB[l][i] = TrainSet[l][it->index];
     }
+}
 
-    double Dist = 0;
-    for(unsigned int c = 0; c < num_labels; ++c) {
+// Splits the pixels of a node in place: the range of each class is partitioned stably into the pixels with
+// a value below t (left child) and the others (right child). valSet holds the values of the range in order
+// and is reused as buffer for the pixels of the right child
+void CRTree::partition(const GrowNode& open, vector< vector< IntIndex > >& valSet, int t, GrowNode& childA, GrowNode& childB) {
+
+    unsigned int nlabels = open.begin.size();
+    childA.begin = open.begin;
+    childA.end.resize( nlabels );
+    childB.begin.resize( nlabels );
+    childB.end = open.end;
+
+    for(unsigned int l = 0; l < nlabels; ++l) {
+
+        int a = open.begin[l];
+        int b = 0;
+        for(int i = open.begin[l]; i < open.end[l]; ++i) {
+            // the value of the pixel is read before its entry may be overwritten (b <= i - begin)
+            if( valSet[l][ i - open.begin[l] ].val < t )
+                sampleOrder[l][a++] = sampleOrder[l][i];
+            else
+                valSet[l][b++].index = sampleOrder[l][i];
+        }
+        for(int j = 0; j < b; ++j)
+            sampleOrder[l][a + j] = valSet[l][j].index;
 
-        Dist += dist[c];
+        childA.end[l] = a;
+        childB.begin[l] = a;
     }
+}
 
-    return Dist;
+// Spread of the object orientations of the pixels in both sets, see orientationMeanStats
+double CRTree::orientationMeanMC(const std::vector<std::vector< int> >& SetA, const std::vector<std::vector< int> >& SetB) {
+
+    vector< RotationStats > rotA, rotB;
+    setRotationStats( SetA, rotA );
+    setRotationStats( SetB, rotB );
+    return orientationMeanStats( rotA, rotB );
 }
 
 
 // this code uses the class label!!!!
-double CRTree::distMeanMC(const vector<vector< PixelFeature*> >& SetA, const vector<vector< PixelFeature*> >& SetB) {
+double CRTree::distMeanMC(const vector<vector< int> >& SetA, const vector<vector< int> >& SetB) {
     // calculating location entropy per class
     vector<double> meanAx(num_labels,0);
     vector<double> meanAy(num_labels,0);
     vector<double> meanAz(num_labels,0);
     for(unsigned int c = 0; c<num_labels; ++c) {
         if(class_id[c]>0) {
-            for(vector< PixelFeature*>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
-                meanAx[c] += (*it)->disVector.x;
-                meanAy[c] += (*it)->disVector.y;
-                meanAz[c] += (*it)->disVector.z;
+            for(vector< int>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
+                meanAx[c] += sampleOffset( c, *it ).x;
+                meanAy[c] += sampleOffset( c, *it ).y;
+                meanAz[c] += sampleOffset( c, *it ).z;
             }
         }
     }
@@ -918,12 +962,12 @@ double CRTree::distMeanMC(const vector<vector< PixelFeature*> >& SetA, const vec
         if(class_id[c]>0) {
             if (SetB[c].size() > 0)
                 non_empty_classesA++;
-            for(std::vector< PixelFeature*>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
-                double tmp = (*it)->disVector.x - meanAx[c];
+            for(std::vector< int>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
+                double tmp = sampleOffset( c, *it ).x - meanAx[c];
                 distA[c] += tmp*tmp;
-                tmp = (*it)->disVector.y - meanAy[c];
+                tmp = sampleOffset( c, *it ).y - meanAy[c];
                 distA[c] += tmp*tmp;
-                tmp = (*it)->disVector.z - meanAz[c];
+                tmp = sampleOffset( c, *it ).z - meanAz[c];
                 distA[c] += tmp*tmp;
             }
         }
@@ -934,10 +978,10 @@ double CRTree::distMeanMC(const vector<vector< PixelFeature*> >& SetA, const vec
     vector<double> meanBz(num_labels,0);
     for(unsigned int c = 0; c<num_labels; ++c) {
         if(class_id[c]>0) {
-            for(vector< PixelFeature*>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
-                meanBx[c] += (*it)->disVector.x;
-                meanBy[c] += (*it)->disVector.y;
-                meanBz[c] += (*it)->disVector.z;
+            for(vector< int>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
+                meanBx[c] += sampleOffset( c, *it ).x;
+                meanBy[c] += sampleOffset( c, *it ).y;
+                meanBz[c] += sampleOffset( c, *it ).z;
 
             }
         }
@@ -958,12 +1002,12 @@ double CRTree::distMeanMC(const vector<vector< PixelFeature*> >& SetA, const vec
             if (SetB[c].size() > 0)
                 non_empty_classesB++;
 
-            for(std::vector< PixelFeature*>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
-                double tmp = (*it)->disVector.x - meanBx[c];
+            for(std::vector< int>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
+                double tmp = sampleOffset( c, *it ).x - meanBx[c];
                 distB[c] += tmp*tmp;
-                tmp = (*it)->disVector.y - meanBy[c];
+                tmp = sampleOffset( c, *it ).y - meanBy[c];
                 distB[c] += tmp*tmp;
-                tmp = (*it)->disVector.z - meanBz[c];
+                tmp = sampleOffset( c, *it ).z - meanBz[c];
                 distB[c] += tmp*tmp;
             }
         }
@@ -981,7 +1025,7 @@ double CRTree::distMeanMC(const vector<vector< PixelFeature*> >& SetA, const vec
 }
 
 
-double CRTree::distMean(const vector<vector< PixelFeature*> >& SetA, const vector<vector< PixelFeature*> >& SetB) {
+double CRTree::distMean(const vector<vector< int> >& SetA, const vector<vector< int> >& SetB) {
     // total location entropy (class-independent)
     double meanAx = 0;
     double meanAy = 0;
@@ -990,10 +1034,10 @@ double CRTree::distMean(const vector<vector< PixelFeature*> >& SetA, const vecto
     for(unsigned int c = 0; c<num_labels; ++c) {
         if(class_id[c]>0) {
             countA += SetA[c].size();
-            for(vector< PixelFeature*>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
-                meanAx += (*it)->disVector.x;
-                meanAy += (*it)->disVector.y;
-                meanAz += (*it)->disVector.z;
+            for(vector< int>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
+                meanAx += sampleOffset( c, *it ).x;
+                meanAy += sampleOffset( c, *it ).y;
+                meanAz += sampleOffset( c, *it ).z;
             }
         }
     }
@@ -1006,12 +1050,12 @@ double CRTree::distMean(const vector<vector< PixelFeature*> >& SetA, const vecto
     double distA = 0;
     for(unsigned int c = 0; c<num_labels; ++c) {
         if(class_id[c]>0) {
-            for(std::vector< PixelFeature*>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
-                double tmp = (*it)->disVector.x - meanAx;
+            for(std::vector< int>::const_iterator it = SetA[c].begin(); it != SetA[c].end(); ++it) {
+                double tmp = sampleOffset( c, *it ).x - meanAx;
                 distA += tmp*tmp;
-                tmp = (*it)->disVector.y - meanAy;
+                tmp = sampleOffset( c, *it ).y - meanAy;
                 distA += tmp*tmp;
-                tmp = (*it)->disVector.z - meanAz;
+                tmp = sampleOffset( c, *it ).z - meanAz;
                 distA += tmp*tmp;
             }
         }
@@ -1024,10 +1068,10 @@ double CRTree::distMean(const vector<vector< PixelFeature*> >& SetA, const vecto
     for(unsigned int c = 0; c<num_labels; ++c) {
         if(class_id[c]>0) {
             countB += SetB[c].size();
-            for(vector< PixelFeature*>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
-                meanBx += (*it)->disVector.x;
-                meanBy += (*it)->disVector.y;
-                meanBz += (*it)->disVector.z;
+            for(vector< int>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
+                meanBx += sampleOffset( c, *it ).x;
+                meanBy += sampleOffset( c, *it ).y;
+                meanBz += sampleOffset( c, *it ).z;
             }
         }
     }
@@ -1039,12 +1083,12 @@ double CRTree::distMean(const vector<vector< PixelFeature*> >& SetA, const vecto
     double distB = 0;
     for(unsigned int c = 0; c<num_labels; ++c) {
         if(class_id[c]>0) {
-            for(std::vector< PixelFeature*>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
-                double tmp = (*it)->disVector.x - meanBx;
+            for(std::vector< int>::const_iterator it = SetB[c].begin(); it != SetB[c].end(); ++it) {
+                double tmp = sampleOffset( c, *it ).x - meanBx;
                 distB += tmp*tmp;
-                tmp = (*it)->disVector.y - meanBy;
+                tmp = sampleOffset( c, *it ).y - meanBy;
                 distB += tmp*tmp;
-                tmp = (*it)->disVector.z - meanBz;
+                tmp = sampleOffset( c, *it ).z - meanBz;
                 distB += tmp*tmp;
             }
         }
@@ -1053,9 +1097,293 @@ double CRTree::distMean(const vector<vector< PixelFeature*> >& SetA, const vecto
 }
 
 
+// Times the measures of random splits of the training pixels, at most 1000 per class as in optimizeTest:
+// the reference measures on the split sets, the same measures from the statistics of the sets and the
+// sweep over all thresholds of a test. maxDifference is the largest relative difference of the first two
+void CRTree::benchmarkMeasures(const Parameters& param, const CRPixel& TrData, int tests, double tolerance, double& referenceTime, double& statsTime, double& sweepTime, double& maxDifference, int& sweepMisses) {
+
+    trainingData = &TrData;
+    unsigned int nlabels = TrData.samples.size();
+
+    vector< vector< int > > TrainSet( nlabels );
+    vector< float > vRatio( nlabels, 0.f );
+
+    for(unsigned int l = 0; l < nlabels; ++l) {
+        unsigned int n = std::min( (unsigned int)TrData.samples[l].size(), 1000u );
+        for(unsigned int j = 0; j < n; ++j)
+            TrainSet[l].push_back( (unsigned long)TrData.samples[l].size() * j / n );
+        if( n > 0 )
+            vRatio[l] = 1.0f / n;
+    }
+
+    referenceTime = 0;
+    statsTime = 0;
+    sweepTime = 0;
+    maxDifference = 0;
+    sweepMisses = 0;
+
+    // find non-empty class
+    int check_label = 0;
+    while(check_label < (int)nlabels && TrainSet[check_label].size() == 0)
+        ++check_label;
+    if( check_label == (int)nlabels )
+        return;
+
+    vector< vector< int > > SetA( nlabels ), SetB( nlabels );
+
+    for(int i = 0; i < tests; ++i) {
+
+        int test[6];
+        generateTest(param, &test[0], class_size[0].first, class_size[0].second, TrData.images[0].channels(), rng);
+
+        vector< vector< IntIndex > > valSet( nlabels );
+        for(unsigned int l = 0; l < nlabels; ++l)
+            evaluateTest( valSet[l], &test[0], l, TrainSet[l].empty() ? NULL : &TrainSet[l][0], TrainSet[l].size() );
+
+        int vmin = INT_MAX;
+        int vmax = INT_MIN;
+        for(unsigned int l = 0; l < nlabels; ++l) {
+            if(valSet[l].size() > 0) {
+                vmin = std::min( vmin, valSet[l].front().val );
+                vmax = std::max( vmax, valSet[l].back().val );
+            }
+        }
+        if( vmax <= vmin )
+            continue;
+
+        // best reference measure of the random thresholds which optimizeTest would accept, per mode
+        double bestRandom[ 2 ] = { -DBL_MAX, -DBL_MAX };
+
+        // classification (0) and regression (2) measures of 10 random thresholds as in optimizeTest
+        for(int j = 0; j < 10; ++j) {
+
+            int tr = rng(vmax - vmin) + vmin;
+            split(SetA, SetB, TrainSet, valSet, tr);
+
+            int countA = 0;
+            int countB = 0;
+            for(unsigned int l = 0; l < nlabels; ++l) {
+                countA = std::max( countA, (int)SetA[l].size() );
+                countB = std::max( countB, (int)SetB[l].size() );
+            }
+
+            for(int mode = 0; mode <= 2; mode += 2) {
+
+                int64 tick = cv::getTickCount();
+                double reference = measureSetReference( SetA, SetB, mode, vRatio );
+                referenceTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
+
+                tick = cv::getTickCount();
+                double stats = measureSet( SetA, SetB, mode, vRatio, false );
+                statsTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
+
+                // empty classes give nan in both
+                if( !isnan(reference) && !isnan(stats) )
+                    maxDifference = std::max( maxDifference, std::abs( reference - stats ) / std::max( 1.0, std::abs( reference ) ) );
+
+                if( countA > 10 && countB > 10 && !isnan(reference) )
+                    bestRandom[ mode / 2 ] = std::max( bestRandom[ mode / 2 ], reference );
+            }
+        }
+
+        for(int mode = 0; mode <= 2; mode += 2) {
+
+            double dist;
+            int threshold;
+            int64 tick = cv::getTickCount();
+            bool found = optimizeThresholdSweep( valSet, TrainSet, mode, false, vRatio, dist, threshold );
+            sweepTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
+
+            if( !found )
+                continue;
+
+            // the measure of the sweep has to match the reference on the split at its threshold
+            split(SetA, SetB, TrainSet, valSet, threshold);
+            double reference = measureSetReference( SetA, SetB, mode, vRatio );
+            if( !isnan(reference) && !isnan(dist) )
+                maxDifference = std::max( maxDifference, std::abs( reference - dist ) / std::max( 1.0, std::abs( reference ) ) );
+
+            // the sweep tries all thresholds, so it is at least as good as the random ones
+            double best = bestRandom[ mode / 2 ];
+            if( best > -DBL_MAX && dist < best - tolerance * std::max( 1.0, std::abs( best ) ) )
+                ++sweepMisses;
+        }
+    }
+}
+
+// Random test of the node id of benchmarkSets, evaluated on the pixels of the node, and the value of a random pixel
+// of the node as threshold
+int CRTree::benchmarkThreshold(const Parameters& param, int id, const vector< const int* >& samples, const vector< int >& sizes, vector< vector< IntIndex > >& valSet) {
+
+    StreamRNG nodeRNG = rng.stream( id );
+    int test[6];
+    generateTest(param, &test[0], class_size[0].first, class_size[0].second, trainingData->images[0].channels(), nodeRNG);
+
+    int total = 0;
+    for(unsigned int l = 0; l < sizes.size(); ++l) {
+        evaluateTest( valSet[l], &test[0], l, samples[l], sizes[l], false );
+        total += sizes[l];
+    }
+
+    int pick = nodeRNG( total );
+    for(unsigned int l = 0; l < sizes.size(); ++l) {
+        if( pick < sizes[l] )
+            return valSet[l][pick].val;
+        pick -= sizes[l];
+    }
+    return 0;
+}
+
+bool CRTree::benchmarkSets(const Parameters& param, const CRPixel& TrData, const vector< vector< int > >& numbers, int depth, double& copyTime, double& copyMemory, double& inPlaceTime, double& inPlaceMemory) {
+
+    trainingData = &TrData;
+    unsigned int nlabels = numbers.size();
+    vector< vector< IntIndex > > valSet( nlabels );
+    vector< const int* > samples( nlabels );
+    vector< int > sizes( nlabels );
+
+    // sizes of the left children in the order of the nodes, the same for both
+    vector< int > copyNodes, inPlaceNodes;
+
+    // copied sets: each node owns the indices of its pixels, they are copied into new sets of its children
+    copyTime = 0;
+    resetPeakMemory();
+    double base = currentMemory();
+    {
+        vector< vector< vector< int > > > level( 1, numbers );
+        int id = 0;
+        for( int d = 0; d < depth && !level.empty(); ++d ) {
+
+            vector< vector< vector< int > > > next;
+            for( unsigned int n = 0; n < level.size(); ++n ) {
+
+                const vector< vector< int > >& set = level[n];
+                int total = 0;
+                for(unsigned int l = 0; l < nlabels; ++l) {
+                    samples[l] = set[l].empty() ? NULL : &set[l][0];
+                    sizes[l] = set[l].size();
+                    total += sizes[l];
+                }
+                if( total < 2 * (int)min_samples )
+                    continue;
+
+                int t = benchmarkThreshold( param, id++, samples, sizes, valSet );
+
+                int64 tick = cv::getTickCount();
+                next.push_back( vector< vector< int > >( nlabels ) );
+                next.push_back( vector< vector< int > >( nlabels ) );
+                vector< vector< int > >& SetA = next[ next.size() - 2 ];
+                vector< vector< int > >& SetB = next.back();
+                for(unsigned int l = 0; l < nlabels; ++l)
+                    for(int i = 0; i < sizes[l]; ++i)
+                        ( valSet[l][i].val < t ? SetA[l] : SetB[l] ).push_back( set[l][i] );
+                copyTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
+
+                int countA = 0;
+                for(unsigned int l = 0; l < nlabels; ++l)
+                    countA += SetA[l].size();
+                copyNodes.push_back( countA );
+            }
+
+            int64 tick = cv::getTickCount();
+            level.swap( next );
+            vector< vector< vector< int > > >().swap( next );
+            copyTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
+        }
+    }
+    copyMemory = peakMemory() - base;
+
+    // in place: the nodes are ranges of the permutation which is partitioned by the splits
+    inPlaceTime = 0;
+    resetPeakMemory();
+    base = currentMemory();
+    {
+        sampleOrder = numbers;
+        vector< GrowNode > level( 1 );
+        level[0].begin.assign( nlabels, 0 );
+        level[0].end.resize( nlabels );
+        for(unsigned int l = 0; l < nlabels; ++l)
+            level[0].end[l] = sampleOrder[l].size();
+
+        int id = 0;
+        for( int d = 0; d < depth && !level.empty(); ++d ) {
+
+            vector< GrowNode > next;
+            for( unsigned int n = 0; n < level.size(); ++n ) {
+
+                const GrowNode& open = level[n];
+                int total = 0;
+                for(unsigned int l = 0; l < nlabels; ++l) {
+                    samples[l] = nodeSamples( open, l );
+                    sizes[l] = open.size( l );
+                    total += sizes[l];
+                }
+                if( total < 2 * (int)min_samples )
+                    continue;
+
+                int t = benchmarkThreshold( param, id++, samples, sizes, valSet );
+
+                int64 tick = cv::getTickCount();
+                GrowNode childA, childB;
+                partition( open, valSet, t, childA, childB );
+                inPlaceTime += (cv::getTickCount() - tick) / cv::getTickFrequency();
+
+                int countA = 0;
+                for(unsigned int l = 0; l < nlabels; ++l)
+                    countA += childA.size( l );
+                inPlaceNodes.push_back( countA );
+
+                next.push_back( childA );
+                next.push_back( childB );
+            }
+            level.swap( next );
+        }
+        vector< vector< int > >().swap( sampleOrder );
+    }
+    inPlaceMemory = peakMemory() - base;
+
+    return copyNodes == inPlaceNodes;
+}
+
+// Pose measure on the orientation statistics: for each object class and set the sum of 1 - (q.q_mean)^2
+// over its pixels, where q_mean is the mean orientation of the class in the set
+double CRTree::orientationMeanStats(const vector< RotationStats >& rotA, const vector< RotationStats >& rotB) {
+
+    double Dist = 0;
+    for(unsigned int c = 0; c < num_labels; ++c) {
+        if(class_id[c] > 0)
+            Dist += rotA[c].dispersion() + rotB[c].dispersion();
+    }
+    return Dist;
+}
+
+// distMeanMC and distMean on the statistics of the classes
+double CRTree::distMeanMCStats(const vector< SplitStats >& statA, const vector< SplitStats >& statB) {
+
+    double Dist = 0;
+    for(unsigned int c = 0; c < num_labels; ++c) {
+        if(class_id[c] > 0)
+            Dist += statA[c].scatter() + statB[c].scatter();
+    }
+    return Dist;
+}
+
+double CRTree::distMeanStats(const vector< SplitStats >& statA, const vector< SplitStats >& statB) {
+
+    SplitStats A, B;
+    for(unsigned int c = 0; c < num_labels; ++c) {
+        if(class_id[c] > 0) {
+            A.add( statA[c] );
+            B.add( statB[c] );
+        }
+    }
+    return A.scatter() + B.scatter();
+}
+
+
 // optimization functions for class impurity
 
-double CRTree::InfGain(const vector<vector< PixelFeature*> >& SetA, const vector<vector< PixelFeature*> >& SetB, const std::vector<float>& vRatio) {
+double CRTree::InfGain(const vector<vector< int> >& SetA, const vector<vector< int> >& SetB, const std::vector<float>& vRatio) {
     // get size of set A
     double sizeA = 0;
     vector<float> countA(SetA.size(),0);
@@ -1091,7 +1419,36 @@ double CRTree::InfGain(const vector<vector< PixelFeature*> >& SetA, const vector
     return (sizeA*n_entropyA+sizeB*n_entropyB);
 }
 
-double CRTree::InfGainBG(const vector<vector< PixelFeature*> >& SetA, const vector<vector< PixelFeature*> >& SetB, const std::vector<float>& vRatio) {
+// InfGain (background = false) and InfGainBG (background = true) on the statistics of the classes
+double CRTree::InfGainStats(const vector< SplitStats >& statA, const vector< SplitStats >& statB, const std::vector<float>& vRatio, bool background) {
+
+    double gain = 0;
+    for(int s = 0; s < 2; ++s) {
+
+        const vector< SplitStats >& stat = s == 0 ? statA : statB;
+
+        double size = 0;
+        vector<double> count(stat.size(), 0);
+        int group = 0;
+        for(unsigned int i = 0; i < stat.size(); ++i) {
+            if(i > 0 && (background ? (class_id[i] > 0) != (class_id[i-1] > 0) : class_id[i] != class_id[i-1])) ++group;
+
+            size += stat[i].n * vRatio[i];
+            count[group] += stat[i].n * vRatio[i];
+        }
+
+        double n_entropy = 0;
+        for(int i = 0; i < group + 1; ++i) {
+            double p = count[i] / size;
+            if(p>0) n_entropy += p*log(p);
+        }
+
+        gain += size*n_entropy;
+    }
+    return gain;
+}
+
+double CRTree::InfGainBG(const vector<vector< int> >& SetA, const vector<vector< int> >& SetB, const std::vector<float>& vRatio) {
     // get size of set A
 
     double sizeA = 0;
@@ -2,6 +2,10 @@
 // Email:       badami@vision.rwth-aachen.de
 #include "utils.h"
 
+#include <Eigen/Eigenvalues>
+#include <cstdlib>
+#include <cstring>
+
 void onMouse( int event, int x, int y, int flags, void* userdata ) {
     if( userdata ) {
         MouseEvent* data = (MouseEvent*) userdata;
@@ -524,6 +528,109 @@ void selectPlane( const cv::Mat& img_rgb, const pcl::PointCloud< pcl::PointXYZRG
 
 }
 
+// Automatic alternative to selectPlane: RANSAC fit of the dominant plane (e.g. table or desk) to the depth image
+// subsampled with step, refined by least squares on its inliers. planeMask marks the pixels closer than inlierThreshold
+// (in meter) to the plane. Returns false if no plane was found or the best plane is supported by less than minSupport
+// of the sampled points
+bool segmentDominantPlane( const cv::Mat& depthImg, float inlierThreshold, cv::Mat& planeMask, Plane& plane, int iterations, int step, float minSupport ) {
+
+    planeMask = cv::Mat::zeros( depthImg.rows, depthImg.cols, CV_8UC1 );
+
+    float focal_length = 525.f;
+    float cx = depthImg.cols / 2.f;
+    float cy = depthImg.rows / 2.f;
+
+    // points of the subsampled depth image
+    std::vector< Eigen::Vector3f > points;
+    points.reserve( ( depthImg.rows / step + 1 ) * ( depthImg.cols / step + 1 ) );
+    for( int y = 0; y < depthImg.rows; y += step ) {
+        const unsigned short* depth = depthImg.ptr< unsigned short >( y );
+        for( int x = 0; x < depthImg.cols; x += step ) {
+            if( depth[ x ] == 0 )
+                continue;
+            float z = depth[ x ] / 1000.f;
+            points.push_back( Eigen::Vector3f( ( x - cx ) * z / focal_length, ( y - cy ) * z / focal_length, z ) );
+        }
+    }
+
+    if( points.size() < 3 )
+        return false;
+
+    // fixed seed, the same frame gives the same plane
+    cv::RNG rng;
+    int bestSupport = 0;
+    Eigen::Vector3f bestNormal( 0.f, 0.f, 1.f );
+    float bestOffset = 0.f;
+
+    for( int it = 0; it < iterations; it++ ) {
+
+        const Eigen::Vector3f& p0 = points[ rng.uniform( 0, int( points.size() ) ) ];
+        const Eigen::Vector3f& p1 = points[ rng.uniform( 0, int( points.size() ) ) ];
+        const Eigen::Vector3f& p2 = points[ rng.uniform( 0, int( points.size() ) ) ];
+
+        Eigen::Vector3f normal = ( p1 - p0 ).cross( p2 - p0 );
+        float norm = normal.norm();
+        if( norm < 1e-6f )
+            continue;
+        normal /= norm;
+        float offset = -normal.dot( p0 );
+
+        int support = 0;
+        for( unsigned int i = 0; i < points.size(); i++ )
+            if( std::fabs( normal.dot( points[ i ] ) + offset ) < inlierThreshold )
+                support++;
+
+        if( support > bestSupport ) {
+            bestSupport = support;
+            bestNormal = normal;
+            bestOffset = offset;
+        }
+    }
+
+    // no sample gave a plane (all degenerate)
+    if( bestSupport == 0 || bestSupport < minSupport * points.size() )
+        return false;
+
+    // least squares refinement: the normal is the direction of the smallest variance of the inliers
+    Eigen::Vector3d mean( 0, 0, 0 );
+    Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+    int nInliers = 0;
+    for( unsigned int i = 0; i < points.size(); i++ ) {
+        if( std::fabs( bestNormal.dot( points[ i ] ) + bestOffset ) < inlierThreshold ) {
+            Eigen::Vector3d pt = points[ i ].cast< double >();
+            mean += pt;
+            covariance += pt * pt.transpose();
+            nInliers++;
+        }
+    }
+    if( nInliers < 3 )
+        return false;
+    mean /= nInliers;
+    covariance = covariance / nInliers - mean * mean.transpose();
+
+    Eigen::SelfAdjointEigenSolver< Eigen::Matrix3d > solver( covariance );
+    Eigen::Vector3d normal = solver.eigenvectors().col( 0 );
+
+    plane.coefficients = Eigen::Vector4d( normal[ 0 ], normal[ 1 ], normal[ 2 ], -normal.dot( mean ) );
+    plane.point = mean;
+
+    // mask of all pixels on the plane
+    for( int y = 0; y < depthImg.rows; y++ ) {
+        const unsigned short* depth = depthImg.ptr< unsigned short >( y );
+        uchar* mask = planeMask.ptr< uchar >( y );
+        for( int x = 0; x < depthImg.cols; x++ ) {
+            if( depth[ x ] == 0 )
+                continue;
+            double z = depth[ x ] / 1000.0;
+            Eigen::Vector3d pt( ( x - cx ) * z / focal_length, ( y - cy ) * z / focal_length, z );
+            if( std::fabs( normal.dot( pt ) + plane.coefficients[ 3 ] ) < inlierThreshold )
+                mask[ x ] = 255;
+        }
+    }
+
+    return true;
+}
+
 void getObjectPointCloud( const pcl::PointCloud< pcl::PointXYZRGB >::ConstPtr& cloud, float minHeight, float maxHeight,
                           std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > convexHull, Plane &table_plane, Eigen::Vector3d turnTable_center, pcl::PointCloud<pcl::PointXYZRGB>::Ptr& objectCloud  ) {
 
@@ -1043,5 +1150,31 @@ void getLinePlaneIntersection(Line &line, Plane &plane, Eigen::Vector3d &ptInter
 
 }
 
+// value of an entry of /proc/self/status in MB
+static double statusMemory( const char* entry ) {
+
+    std::ifstream in( "/proc/self/status" );
+    std::string line;
+    size_t length = strlen( entry );
+    while( std::getline( in, line ) ) {
+        if( line.compare( 0, length, entry ) == 0 )
+            return atof( line.c_str() + length ) / 1024.0;
+    }
+    return 0;
+}
+
+double peakMemory() {
+    return statusMemory( "VmHWM:" );
+}
 
+double currentMemory() {
+    return statusMemory( "VmRSS:" );
+}
+
+bool resetPeakMemory() {
 
+    std::ofstream out( "/proc/self/clear_refs" );
+    out << "5";
+    out.close();
+    return !out.fail();
+}